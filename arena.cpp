@@ -0,0 +1,93 @@
+#include "arena.h"
+#include <windows.h>
+#include <cassert>
+
+static uint32_t os_allocation_count = 0;
+
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Large pages can be used only if the process holds SeLockMemoryPrivilege,
+// which has to be explicitly enabled on the process token.
+static bool enable_lock_memory_privilege() {
+    static bool tried = false;
+    static bool enabled = false;
+    if(tried) return enabled;
+    tried = true;
+
+    HANDLE token;
+    if(!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+        return false;
+    }
+
+    TOKEN_PRIVILEGES privileges = {};
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    if(LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)) {
+        // AdjustTokenPrivileges succeeds even if the privilege wasn't assigned, so we have to check last error.
+        AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL);
+        enabled = GetLastError() == ERROR_SUCCESS;
+    }
+    CloseHandle(token);
+
+    return enabled;
+}
+
+Arena arena::get(size_t capacity) {
+    Arena arena = {};
+    arena.memory = (uint8_t *)VirtualAlloc(NULL, capacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    assert(arena.memory);
+    arena.capacity = capacity;
+    os_allocation_count++;
+    return arena;
+}
+
+Arena arena::get_large_pages(size_t capacity) {
+    size_t large_page_size = GetLargePageMinimum();
+    if(large_page_size == 0 || !enable_lock_memory_privilege()) {
+        return arena::get(capacity);
+    }
+
+    // Large page allocations have to be multiple of large page size.
+    capacity = align_up(capacity, large_page_size);
+    void *memory = VirtualAlloc(NULL, capacity, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if(!memory) {
+        // Physical memory can be too fragmented to get contiguous large pages.
+        return arena::get(capacity);
+    }
+
+    Arena arena = {};
+    arena.memory = (uint8_t *)memory;
+    arena.capacity = capacity;
+    arena.large_pages = true;
+    os_allocation_count++;
+    return arena;
+}
+
+void arena::release(Arena *arena) {
+    VirtualFree(arena->memory, 0, MEM_RELEASE);
+    *arena = {};
+}
+
+void *arena::push(Arena *arena, size_t size, size_t alignment) {
+    size_t offset = align_up(arena->used, alignment);
+    if(offset + size > arena->capacity) {
+        assert(false && "Arena out of memory.");
+        return NULL;
+    }
+
+    arena->used = offset + size;
+    if(arena->used > arena->high_water_mark) {
+        arena->high_water_mark = arena->used;
+    }
+    return arena->memory + offset;
+}
+
+void arena::reset(Arena *arena) {
+    arena->used = 0;
+}
+
+uint32_t arena::get_os_allocation_count() {
+    return os_allocation_count;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Bump allocator for CPU side render data.
+// All memory is reserved and committed when the arena is created, so pushing
+// onto an arena never goes back to the OS. Arenas are not thread-safe, every
+// thread that needs scratch memory should own its own arena.
+struct Arena {
+    uint8_t *memory;
+    size_t capacity;
+    size_t used;
+    size_t high_water_mark;
+    bool large_pages;
+};
+
+namespace arena {
+    // Creates arena backed by regular pages.
+    Arena get(size_t capacity);
+    // Creates arena backed by large pages, meant for long-lived buffers.
+    // Falls back to regular pages if the process can't lock large pages.
+    Arena get_large_pages(size_t capacity);
+    void release(Arena *arena);
+
+    // Returns NULL if the arena is out of memory.
+    void *push(Arena *arena, size_t size, size_t alignment = 16);
+    template<typename T>
+    T *push_array(Arena *arena, size_t count) {
+        return (T *)push(arena, sizeof(T) * count, alignof(T) > 16 ? alignof(T) : 16);
+    }
+
+    // Frees everything pushed onto the arena.
+    void reset(Arena *arena);
+
+    // Number of times arenas had to request memory from the OS since the start.
+    // This should stay constant once the application is running.
+    uint32_t get_os_allocation_count();
+}
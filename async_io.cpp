@@ -0,0 +1,121 @@
+#include "async_io.h"
+#include <cassert>
+#include <string.h>
+
+static double get_seconds() {
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return double(counter.QuadPart) / double(frequency.QuadPart);
+}
+
+// Collects a single completed write, waiting at most timeout milliseconds. Returns false if nothing completed.
+static bool complete_write(AsyncWriter *writer, DWORD timeout) {
+    DWORD bytes_written;
+    ULONG_PTR key;
+    OVERLAPPED *overlapped;
+    BOOL success = GetQueuedCompletionStatus(writer->port, &bytes_written, &key, &overlapped, timeout);
+    if(!overlapped) return false;
+    assert(success);
+
+    AsyncWrite *write = &writer->writes[key];
+    CloseHandle(write->file);
+    write->file = NULL;
+    write->busy = false;
+    writer->pending_count--;
+    return true;
+}
+
+// Waits until the write completes, collecting other completions on the way.
+static void wait_for(AsyncWriter *writer, AsyncWrite *write) {
+    while(write->busy) {
+        complete_write(writer, INFINITE);
+    }
+}
+
+AsyncWriter async_io::get(int writes_count, size_t buffer_capacity, bool blocking) {
+    AsyncWriter writer = {};
+    writer.port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    assert(writer.port);
+
+    // Buffers are aligned to pages, so the system doesn't have to split them when locking them for the transfer.
+    const size_t BUFFER_ALIGNMENT = 4096;
+    writer.buffer_capacity = (buffer_capacity + BUFFER_ALIGNMENT - 1) & ~(BUFFER_ALIGNMENT - 1);
+    size_t writes_size = sizeof(AsyncWrite) * writes_count;
+    writer.arena = arena::get(writes_size + 16 + (writer.buffer_capacity + BUFFER_ALIGNMENT) * writes_count);
+    writer.writes = arena::push_array<AsyncWrite>(&writer.arena, writes_count);
+    assert(writer.writes);
+    memset(writer.writes, 0, writes_size);
+    for(int i = 0; i < writes_count; ++i) {
+        writer.writes[i].buffer = (uint8_t *)arena::push(&writer.arena, writer.buffer_capacity, BUFFER_ALIGNMENT);
+        assert(writer.writes[i].buffer);
+    }
+    writer.writes_count = writes_count;
+    writer.blocking = blocking;
+    return writer;
+}
+
+void async_io::release(AsyncWriter *writer) {
+    wait_all(writer);
+    CloseHandle(writer->port);
+    arena::release(&writer->arena);
+}
+
+uint8_t *async_io::get_buffer(AsyncWriter *writer) {
+    // Take any free buffer, otherwise wait for the first write to complete.
+    poll(writer);
+    double start = get_seconds();
+    while(true) {
+        for(int i = 0; i < writer->writes_count; ++i) {
+            AsyncWrite *write = &writer->writes[i];
+            if(!write->busy) {
+                write->busy = true;
+                writer->wait_time += get_seconds() - start;
+                return write->buffer;
+            }
+        }
+        // All buffers reserved and none of them submitted would wait forever.
+        assert(writer->pending_count > 0);
+        complete_write(writer, INFINITE);
+    }
+}
+
+void async_io::write_file(AsyncWriter *writer, uint8_t *buffer, size_t size, char *path) {
+    // Opening the file and submitting the write can block as well, e.g. when the write completes synchronously,
+    // so the whole call counts as waiting.
+    double start = get_seconds();
+    int index = 0;
+    while(index < writer->writes_count && writer->writes[index].buffer != buffer) index++;
+    assert(index < writer->writes_count && size <= writer->buffer_capacity);
+    AsyncWrite *write = &writer->writes[index];
+
+    write->file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+    assert(write->file != INVALID_HANDLE_VALUE);
+    HANDLE port = CreateIoCompletionPort(write->file, writer->port, ULONG_PTR(index), 0);
+    assert(port == writer->port);
+
+    // Completion is queued on the port even if the write finishes immediately,
+    // which happens e.g. when NTFS decides to extend the file synchronously.
+    memset(&write->overlapped, 0, sizeof(OVERLAPPED));
+    BOOL success = WriteFile(write->file, buffer, DWORD(size), NULL, &write->overlapped);
+    assert(success || GetLastError() == ERROR_IO_PENDING);
+    writer->pending_count++;
+
+    if(writer->blocking) {
+        wait_for(writer, write);
+    }
+    writer->wait_time += get_seconds() - start;
+}
+
+int async_io::poll(AsyncWriter *writer) {
+    while(writer->pending_count > 0 && complete_write(writer, 0)) {}
+    return writer->pending_count;
+}
+
+void async_io::wait_all(AsyncWriter *writer) {
+    double start = get_seconds();
+    while(writer->pending_count > 0) {
+        complete_write(writer, INFINITE);
+    }
+    writer->wait_time += get_seconds() - start;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <windows.h>
+#include "arena.h"
+
+// Single in-flight file write. Its buffer is owned by the writer and reused once the write completes.
+struct AsyncWrite {
+    OVERLAPPED overlapped;
+    HANDLE file;
+    uint8_t *buffer;
+    bool busy;
+};
+
+// Asynchronous file writer. Files are written with overlapped I/O and completions are collected from an I/O
+// completion port, so the thread submitting writes keeps feeding the GPU while the disk works.
+// Writes go from fixed set of buffers allocated up front, a write waits only if all of them are in flight.
+// In blocking mode every write waits for its completion, which is useful for comparison.
+struct AsyncWriter {
+    HANDLE port;
+    Arena arena;
+    AsyncWrite *writes;
+    int writes_count;
+    size_t buffer_capacity;
+    int pending_count;
+    bool blocking;
+
+    // Time the submitting thread spent blocked on writes, in seconds. Includes opening files and submitting writes,
+    // not just waiting for completions, so asynchronous and blocking mode can be compared directly.
+    double wait_time;
+};
+
+namespace async_io {
+    AsyncWriter get(int writes_count, size_t buffer_capacity, bool blocking);
+    // Waits for all pending writes.
+    void release(AsyncWriter *writer);
+
+    // Returns buffer for the next write, waiting for a write to complete if all buffers are in flight.
+    // Buffer has buffer_capacity bytes and stays reserved until it's passed to write_file.
+    uint8_t *get_buffer(AsyncWriter *writer);
+    // Starts writing size bytes of buffer from get_buffer into a new file at path.
+    void write_file(AsyncWriter *writer, uint8_t *buffer, size_t size, char *path);
+
+    // Collects completed writes without waiting. Returns number of writes still in flight.
+    int poll(AsyncWriter *writer);
+    void wait_all(AsyncWriter *writer);
+}
@@ -0,0 +1,82 @@
+#include "camera.h"
+
+Vector3 camera::get_orbit_position(float azimuth, float polar, float radius) {
+    return Vector3(
+        math::sin(azimuth) * math::sin(polar),
+        math::cos(polar),
+        math::cos(azimuth) * math::sin(polar)
+    ) * radius;
+}
+
+CameraBasis camera::get_basis(Vector3 position, float aspect_ratio, CameraModel model) {
+    Vector3 back = position;
+    if(model == CAMERA_PANORAMA) {
+        back.y = 0.0f;
+    }
+    back = math::normalize(back);
+
+    CameraBasis basis = {};
+    basis.right = math::normalize(math::cross(Vector3(0, 1, 0), back));
+    basis.up = math::normalize(math::cross(back, basis.right));
+    basis.forward = -back;
+
+    // Film spans [-1, 1] horizontally at unit distance.
+    basis.film_half_width = 1.0f;
+    basis.film_half_height = 1.0f / aspect_ratio;
+
+    // Orthographic film has the same size as perspective film at the origin.
+    basis.ortho_scale = math::length(position);
+    return basis;
+}
+
+bool camera::project(Vector3 point, Vector3 position, CameraBasis *basis, CameraModel model, Vector2 *film) {
+    Vector3 d = point - position;
+    float x = math::dot(d, basis->right);
+    float y = math::dot(d, basis->up);
+    float z = math::dot(d, basis->forward);
+    if(model == CAMERA_PANORAMA) {
+        float distance = math::length(d);
+        if(distance <= 0.0f) return false;
+        film->x = math::atan2(x, z) / math::PI2 + 0.5f;
+        film->y = math::asin(y / distance) / math::PI + 0.5f;
+        return true;
+    }
+    if(model == CAMERA_ORTHOGRAPHIC) {
+        x /= basis->ortho_scale;
+        y /= basis->ortho_scale;
+    } else {
+        if(z <= 0.0f) return false;
+        x /= z;
+        y /= z;
+    }
+    film->x = (x / basis->film_half_width + 1.0f) * 0.5f;
+    film->y = (y / basis->film_half_height + 1.0f) * 0.5f;
+    return true;
+}
+
+CameraModel camera::get_model(bool panorama, bool orthographic, float lens_radius) {
+    if(panorama) return CAMERA_PANORAMA;
+    if(orthographic) return CAMERA_ORTHOGRAPHIC;
+    if(lens_radius > 0.0f) return CAMERA_THIN_LENS;
+    return CAMERA_PINHOLE;
+}
+
+char *camera::get_model_name(CameraModel model) {
+    switch(model) {
+        case CAMERA_PINHOLE: return "pinhole";
+        case CAMERA_THIN_LENS: return "thin lens";
+        case CAMERA_ORTHOGRAPHIC: return "orthographic";
+        case CAMERA_PANORAMA: return "panorama";
+        default: return "";
+    }
+}
+
+char *camera::get_model_define(CameraModel model) {
+    switch(model) {
+        case CAMERA_PINHOLE: return "CAMERA_PINHOLE";
+        case CAMERA_THIN_LENS: return "CAMERA_THIN_LENS";
+        case CAMERA_ORTHOGRAPHIC: return "CAMERA_ORTHOGRAPHIC";
+        case CAMERA_PANORAMA: return "CAMERA_PANORAMA";
+        default: return "CAMERA_PINHOLE";
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "maths.h"
+
+// Camera models. Ray tracing shader is compiled for every model, so each one gets its own specialized ray generation.
+enum CameraModel {
+    CAMERA_PINHOLE = 0,
+    CAMERA_THIN_LENS = 1,
+    CAMERA_ORTHOGRAPHIC = 2,
+    CAMERA_PANORAMA = 3,
+    CAMERA_MODELS_COUNT,
+};
+
+// Camera's frame in shader's layout. It's computed once per frame, so the shader doesn't rebuild it for every sample.
+struct CameraBasis {
+    Vector3 right;
+    // Half of the film's width at unit distance from the camera.
+    float film_half_width;
+    Vector3 up;
+    float film_half_height;
+    // Points from the camera towards the origin.
+    Vector3 forward;
+    // Orthographic camera's film is this many times larger than the film at unit distance.
+    float ortho_scale;
+};
+
+namespace camera {
+    // Position of camera orbiting around the origin.
+    Vector3 get_orbit_position(float azimuth, float polar, float radius);
+
+    // Basis of camera at position looking at the origin. Panorama's basis keeps the horizon level.
+    CameraBasis get_basis(Vector3 position, float aspect_ratio, CameraModel model);
+
+    // Position of point on the film as fractions of its width and height, matching the shader's ray generation.
+    // Returns false if the point isn't in front of the camera.
+    bool project(Vector3 point, Vector3 position, CameraBasis *basis, CameraModel model, Vector2 *film);
+
+    // Picks the simplest model which can render given settings.
+    CameraModel get_model(bool panorama, bool orthographic, float lens_radius);
+    char *get_model_name(CameraModel model);
+    // Value of CAMERA_MODEL shader define.
+    char *get_model_define(CameraModel model);
+}
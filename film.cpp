@@ -0,0 +1,90 @@
+#include "film.h"
+#include <math.h>
+
+// Number of steps used to integrate the filter when building its table.
+static const int INTEGRATION_STEPS = 4096;
+
+char *film::get_filter_name(FilmFilter filter) {
+    switch(filter) {
+        case FILTER_BOX: return "box";
+        case FILTER_GAUSSIAN: return "gaussian";
+        case FILTER_MITCHELL: return "mitchell";
+        case FILTER_BLACKMAN_HARRIS: return "blackman-harris";
+        default: return "";
+    }
+}
+
+float film::get_filter_radius(FilmFilter filter) {
+    switch(filter) {
+        case FILTER_BOX: return 0.5f;
+        case FILTER_GAUSSIAN: return 1.5f;
+        case FILTER_MITCHELL: return 2.0f;
+        case FILTER_BLACKMAN_HARRIS: return 2.0f;
+        default: return 0.5f;
+    }
+}
+
+float film::evaluate_filter(FilmFilter filter, float x) {
+    float radius = get_filter_radius(filter);
+    x = fabsf(x);
+    if(x > radius) return 0.0f;
+
+    switch(filter) {
+        case FILTER_GAUSSIAN: {
+            // Shifted down, so it reaches zero at the radius.
+            const float SIGMA = 0.5f;
+            return expf(-x * x / (2.0f * SIGMA * SIGMA)) - expf(-radius * radius / (2.0f * SIGMA * SIGMA));
+        }
+        case FILTER_MITCHELL: {
+            // Mitchell-Netravali with B = C = 1/3, negative lobes between 1 and 2 pixels sharpen the edges.
+            const float B = 1.0f / 3.0f, C = 1.0f / 3.0f;
+            if(x < 1.0f) {
+                return ((12 - 9 * B - 6 * C) * x * x * x + (-18 + 12 * B + 6 * C) * x * x + (6 - 2 * B)) / 6.0f;
+            }
+            return ((-B - 6 * C) * x * x * x + (6 * B + 30 * C) * x * x + (-12 * B - 48 * C) * x + (8 * B + 24 * C)) / 6.0f;
+        }
+        case FILTER_BLACKMAN_HARRIS: {
+            // Window spanning the whole support.
+            float t = (x + radius) / (2.0f * radius);
+            float a = 2.0f * 3.14159265f * t;
+            return 0.35875f - 0.48829f * cosf(a) + 0.14128f * cosf(2.0f * a) - 0.01168f * cosf(3.0f * a);
+        }
+        default: return 1.0f;
+    }
+}
+
+void film::get_filter_table(FilmFilter filter, FilterTable *table) {
+    float radius = get_filter_radius(filter);
+    float dx = radius / INTEGRATION_STEPS;
+
+    // Integrals of the filter and its absolute value. Dividing by the filter's integral normalizes it,
+    // dividing by the integral of absolute value is the sampling pdf.
+    float integral = 0.0f, abs_integral = 0.0f;
+    for(int i = 0; i < INTEGRATION_STEPS; ++i) {
+        float f = evaluate_filter(filter, (i + 0.5f) * dx);
+        integral += f * dx;
+        abs_integral += fabsf(f) * dx;
+    }
+    float weight = abs_integral / integral;
+
+    // Walk the CDF and find offset for every table entry.
+    float *entries = &table->entries[0].x;
+    float cdf = 0.0f;
+    int step = 0;
+    for(int i = 0; i < FILTER_TABLE_SIZE; ++i) {
+        float target = float(i) / float(FILTER_TABLE_SIZE - 1) * abs_integral;
+        float x = radius;
+        while(step < INTEGRATION_STEPS) {
+            float f = fabsf(evaluate_filter(filter, (step + 0.5f) * dx));
+            if(cdf + f * dx >= target) {
+                x = (step + (f > 0.0f ? (target - cdf) / (f * dx) : 0.0f)) * dx;
+                break;
+            }
+            cdf += f * dx;
+            step++;
+        }
+
+        entries[i * 2 + 0] = x;
+        entries[i * 2 + 1] = evaluate_filter(filter, x) < 0.0f ? -weight : weight;
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "maths.h"
+
+#define FILTER_TABLE_SIZE 64
+
+// Pixel reconstruction filters. All of them are separable, so they're described by a single axis.
+enum FilmFilter {
+    FILTER_BOX = 0,
+    FILTER_GAUSSIAN = 1,
+    FILTER_MITCHELL = 2,
+    FILTER_BLACKMAN_HARRIS = 3,
+    FILTERS_COUNT,
+};
+
+// Filter sampling table for the shader. Film samples are jittered over the whole filter support, with offsets
+// distributed proportionally to filter's absolute value. Every sample then has weight of the same magnitude,
+// only negative lobes flip its sign, so the filter needs no per-pixel weight sum.
+struct FilterTable {
+    // Inverse CDF of |filter| over [0, radius] at uniformly spaced points, two entries per vector.
+    // First value of an entry is offset in pixels, second is the sample's weight.
+    Vector4 entries[FILTER_TABLE_SIZE / 2];
+};
+
+namespace film {
+    char *get_filter_name(FilmFilter filter);
+    // Filter's support in pixels from the pixel's center.
+    float get_filter_radius(FilmFilter filter);
+    float evaluate_filter(FilmFilter filter, float x);
+
+    void get_filter_table(FilmFilter filter, FilterTable *table);
+}
@@ -0,0 +1,71 @@
+#include "frame_ring.h"
+#include <cassert>
+#include <string.h>
+
+// Pixels are float RGBA.
+static const uint32_t FRAME_RING_PIXEL_SIZE = 16;
+
+FrameRing frame_ring::get(int width, int height, int slots_count) {
+    FrameRing ring = {};
+
+    // Rows and slots are aligned, so readers can copy them with aligned loads.
+    uint32_t row_pitch = (uint32_t(width) * FRAME_RING_PIXEL_SIZE + 63) & ~63u;
+    uint32_t slot_size = (FRAME_RING_SLOT_HEADER_SIZE + row_pitch * uint32_t(height) + 4095) & ~4095u;
+    uint64_t size = FRAME_RING_HEADER_SIZE + uint64_t(slot_size) * uint64_t(slots_count);
+    static_assert(sizeof(FrameRingHeader) <= FRAME_RING_HEADER_SIZE, "Header has to fit before the slots.");
+    static_assert(sizeof(FrameRingSlot) <= FRAME_RING_SLOT_HEADER_SIZE, "Slot header has to fit before the pixels.");
+
+    ring.mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, DWORD(size >> 32), DWORD(size), FRAME_RING_NAME);
+    if(!ring.mapping) return ring;
+    // Existing mapping belongs to another renderer instance or is held open by a viewer. Its size might
+    // not match and the other renderer would keep publishing into it, so the ring is not shared.
+    if(GetLastError() == ERROR_ALREADY_EXISTS) {
+        CloseHandle(ring.mapping);
+        ring.mapping = NULL;
+        return ring;
+    }
+    ring.memory = (uint8_t *)MapViewOfFile(ring.mapping, FILE_MAP_ALL_ACCESS, 0, 0, SIZE_T(size));
+    if(!ring.memory) {
+        CloseHandle(ring.mapping);
+        ring.mapping = NULL;
+        return ring;
+    }
+
+    // New mapping is zeroed, so no slot holds a frame yet.
+    ring.header = (FrameRingHeader *)ring.memory;
+    ring.header->slots_count = uint32_t(slots_count);
+    ring.header->slot_size = slot_size;
+    ring.header->width = uint32_t(width);
+    ring.header->height = uint32_t(height);
+    ring.header->row_pitch = row_pitch;
+    ring.header->version = FRAME_RING_VERSION;
+    // Magic goes last, readers which see it can rely on the rest of the header.
+    MemoryBarrier();
+    ring.header->magic = FRAME_RING_MAGIC;
+    return ring;
+}
+
+void frame_ring::release(FrameRing *ring) {
+    if(ring->memory) UnmapViewOfFile(ring->memory);
+    if(ring->mapping) CloseHandle(ring->mapping);
+    *ring = {};
+}
+
+void frame_ring::publish(FrameRing *ring, void *pixels, int row_pitch, uint32_t step) {
+    assert(ring->memory);
+    FrameRingHeader *header = ring->header;
+    int64_t sequence = header->latest_sequence + 1;
+    uint8_t *slot_memory = ring->memory + FRAME_RING_HEADER_SIZE + size_t((sequence - 1) % header->slots_count) * header->slot_size;
+    FrameRingSlot *slot = (FrameRingSlot *)slot_memory;
+
+    // Odd sequence tells readers the slot is being written. Interlocked writes are full barriers,
+    // so the pixels are never visible outside of the odd/even pair.
+    InterlockedExchange64((volatile LONG64 *)&slot->sequence, sequence * 2 - 1);
+    slot->step = step;
+    uint8_t *destination = slot_memory + FRAME_RING_SLOT_HEADER_SIZE;
+    for(uint32_t y = 0; y < header->height; ++y) {
+        memcpy(destination + size_t(y) * header->row_pitch, (uint8_t *)pixels + size_t(y) * row_pitch, header->width * FRAME_RING_PIXEL_SIZE);
+    }
+    InterlockedExchange64((volatile LONG64 *)&slot->sequence, sequence * 2);
+    InterlockedExchange64((volatile LONG64 *)&header->latest_sequence, sequence);
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <windows.h>
+
+// Shared memory ring of rendered frames for out-of-process viewers. Renderer creates named file mapping
+// FRAME_RING_NAME and publishes frames into it, any local process can open it read-only with OpenFileMappingA
+// and MapViewOfFile(FILE_MAP_READ) and pull the latest frame without the renderer noticing.
+//
+// Layout: FrameRingHeader, followed by slots_count slots of slot_size bytes starting at FRAME_RING_HEADER_SIZE.
+// Every slot starts with FrameRingSlot, frame's pixels follow at FRAME_RING_SLOT_HEADER_SIZE bytes from the slot's start.
+// Pixels are rows of RGBA 32-bit floats, row_pitch bytes apart. Colors are tone-mapped, but not clamped -
+// filters with negative lobes leave values slightly below zero next to edges, clamp to [0,1] for display.
+// Alpha holds number of steps accumulated in the pixel.
+//
+// Reading the latest frame:
+// 1. Read latest_sequence, if it's zero, nothing was published yet. Frame is in slot (latest_sequence - 1) % slots_count.
+// 2. Read slot's sequence, copy the frame, read slot's sequence again.
+// 3. Copy is consistent if both reads returned latest_sequence * 2. Odd value means the slot is being written,
+//    different value means it was overwritten meanwhile, in both cases start again.
+#define FRAME_RING_NAME "Local\\RayTracerFrames"
+#define FRAME_RING_MAGIC 0x52465452 // "RTFR"
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_HEADER_SIZE 4096
+#define FRAME_RING_SLOT_HEADER_SIZE 64
+
+struct FrameRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots_count;
+    uint32_t slot_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t row_pitch;
+    uint32_t padding;
+    // Number of frames published so far, the last one is the latest consistent frame.
+    volatile int64_t latest_sequence;
+};
+
+struct FrameRingSlot {
+    // Frame's sequence number times two, incremented by one while the slot is being written.
+    volatile int64_t sequence;
+    // Rendering step of the frame, steps restart from one after every change of the scene or camera.
+    uint32_t step;
+};
+
+// Renderer's side of the ring.
+struct FrameRing {
+    HANDLE mapping;
+    uint8_t *memory;
+    FrameRingHeader *header;
+};
+
+namespace frame_ring {
+    // Returns ring with NULL memory if the mapping can't be created or another process already has it open.
+    FrameRing get(int width, int height, int slots_count);
+    void release(FrameRing *ring);
+
+    // Copies frame from pixels with given row pitch into the next slot and makes it the latest frame.
+    void publish(FrameRing *ring, void *pixels, int row_pitch, uint32_t step);
+}
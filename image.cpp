@@ -0,0 +1,27 @@
+#include "image.h"
+#include <stdio.h>
+
+// Header with maximum 5 digits per dimension.
+static const size_t PPM_MAX_HEADER_SIZE = 32;
+
+size_t image::get_ppm_size(int width, int height) {
+    return PPM_MAX_HEADER_SIZE + size_t(width) * size_t(height) * 3;
+}
+
+size_t image::encode_ppm(uint8_t *output, float *pixels, int width, int height, int row_pitch) {
+    int header_size = sprintf((char *)output, "P6\n%d %d\n255\n", width, height);
+    uint8_t *out = output + header_size;
+
+    for(int y = 0; y < height; ++y) {
+        float *row = (float *)((uint8_t *)pixels + size_t(y) * row_pitch);
+        for(int x = 0; x < width; ++x) {
+            for(int c = 0; c < 3; ++c) {
+                float value = row[x * 4 + c];
+                value = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+                *out++ = uint8_t(value * 255.0f + 0.5f);
+            }
+        }
+    }
+
+    return size_t(out - output);
+}
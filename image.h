@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+namespace image {
+    // Size of binary PPM file with given resolution, header included.
+    size_t get_ppm_size(int width, int height);
+
+    // Encodes RGBA float pixels, clamped to [0,1] range, into binary PPM, alpha is dropped.
+    // Output has to have at least get_ppm_size bytes. Returns number of bytes written.
+    size_t encode_ppm(uint8_t *output, float *pixels, int width, int height, int row_pitch);
+}
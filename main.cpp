@@ -7,8 +7,21 @@
 #include "font.h"
 #include "input.h"
 #include "colors.h"
+#include "arena.h"
+#include "tile_scheduler.h"
+#include "readback.h"
+#include "image.h"
+#include "film.h"
+#include "camera.h"
+#include "visibility.h"
+#include "async_io.h"
+#include "frame_ring.h"
+#include "tile_stream.h"
+#include "shader_math.h"
 #include <cassert>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define _STR(x) #x
 #define STR(x) _STR(x)
@@ -16,8 +29,104 @@
 #define SPHERES_COUNT 75
 #define GROUP_SIZE_X 32
 #define GROUP_SIZE_Y 32
+// Threads traverse tiles in Morton order, which needs square power of two tiles.
+static_assert(GROUP_SIZE_X == GROUP_SIZE_Y && (GROUP_SIZE_X & (GROUP_SIZE_X - 1)) == 0, "Tiles have to be square with power of two size.");
+#define MAX_TILES_PER_DISPATCH 1024
+#define BATCH_SCENES 17
+#define SWEEP_MAX_VARIANTS 16
+#define RADIANCE_CACHE_WIDTH 1024
+#define RADIANCE_CACHE_ROWS 64
+#define VPL_COUNT 4096
+#define VPL_GROUP_SIZE 64
 
 int main(int argc, char **argv) {
+    // Batch mode renders many random scenes into image files and exits.
+    // Usage: ray_tracer.exe --batch <scenes count> [--size <pixels>] [--samples <count>] [--out <directory>] [--sync-io]
+    //
+    // Sweep mode renders variants of the same view with one parameter changing in steps,
+    // writes them out as a contact sheet and individual images, then exits.
+    // Usage: ray_tracer.exe --sweep <parameter> <from> <to> <variants count> [--samples <count>] [--out <directory>] [--sync-io]
+    //
+    // Images are written asynchronously while the GPU renders, --sync-io makes every write blocking for comparison.
+    //
+    // Interactive mode with --publish also publishes frames into shared memory for other processes, see frame_ring.h.
+    // With --stream <port>, it streams changed tiles of the image to a TCP client, see tile_stream.h.
+    // --watch <port> connects to such stream on this machine instead, verifies every update and exits once it closes.
+    //
+    // --check-scheduler runs headless check of tile scheduling and exits, non-zero exit code means it failed.
+    // --check-math does the same for error bounds of the shader's fast math and accumulation, see shader_math.h.
+    int batch_scenes_count = 0;
+    int batch_scene_size = 64;
+    int samples_count = 256;
+    char *output_path = "output";
+    char *sweep_parameter = NULL;
+    float sweep_from = 0.0f, sweep_to = 0.0f;
+    int sweep_variants_count = 0;
+    bool sync_io = false;
+    bool publish_frames = false;
+    int stream_port = 0;
+    bool check_scheduler = false;
+    bool check_math = false;
+    int watch_port = 0;
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "--sync-io") == 0) sync_io = true;
+        else if(strcmp(argv[i], "--check-scheduler") == 0) check_scheduler = true;
+        else if(strcmp(argv[i], "--check-math") == 0) check_math = true;
+        else if(strcmp(argv[i], "--publish") == 0) publish_frames = true;
+        else if(i + 1 >= argc) break;
+        else if(strcmp(argv[i], "--batch") == 0) batch_scenes_count = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--size") == 0) batch_scene_size = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--samples") == 0) samples_count = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--out") == 0) output_path = argv[++i];
+        else if(strcmp(argv[i], "--stream") == 0) stream_port = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--watch") == 0) watch_port = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--sweep") == 0 && i + 4 < argc) {
+            sweep_parameter = argv[++i];
+            sweep_from = float(atof(argv[++i]));
+            sweep_to = float(atof(argv[++i]));
+            sweep_variants_count = atoi(argv[++i]);
+        }
+    }
+
+    if(check_scheduler) {
+        Arena check_arena = arena::get(1024 * 1024);
+        bool passed = tile_scheduler::check(&check_arena, 100000);
+        arena::release(&check_arena);
+        return passed ? 0 : 1;
+    }
+    if(check_math) {
+        return shader_math::check() ? 0 : 1;
+    }
+
+    // Stream client, headless.
+    if(watch_port > 0) {
+        Arena watch_arena = arena::get(16 * 1024 * 1024);
+        TileStreamClient client;
+        if(!tile_stream::connect(&client, &watch_arena, watch_port)) {
+            printf("Can't connect to stream on port %d.\n", watch_port);
+            arena::release(&watch_arena);
+            return 1;
+        }
+        printf("Watching %dx%d stream.\n", client.width, client.height);
+
+        int updates_count = 0;
+        UpdateHeader update;
+        StreamReceiveResult result;
+        while((result = tile_stream::receive(&client, &update)) == STREAM_RECEIVED) {
+            updates_count++;
+            printf("Step %u: %u tiles, frame matches, %.1f kB received so far.\n",
+                   update.step, update.tiles_count, double(client.bytes_received) / 1024.0);
+        }
+        if(result == STREAM_INVALID) {
+            printf("Update for step %u doesn't match the rendered frame.\n", update.step);
+        } else {
+            printf("Stream closed after %d updates.\n", updates_count);
+        }
+        tile_stream::disconnect(&client);
+        arena::release(&watch_arena);
+        return result == STREAM_INVALID ? 1 : 0;
+    }
+
     // Set up window
     uint32_t window_width = 1280, window_height = 960;
     uint32_t render_target_width = window_width / 2, render_target_height = window_height / 2;
@@ -28,6 +137,11 @@ int main(int argc, char **argv) {
     graphics::init();
     graphics::init_swap_chain(window, window_width, window_height);
 
+    // CPU memory. Transient data lives in the frame arena, which is reset every ray tracing step.
+    // Long-lived buffers are allocated from the persistent arena.
+    Arena frame_arena = arena::get(16 * 1024 * 1024);
+    Arena persistent_arena = arena::get_large_pages(32 * 1024 * 1024);
+
     // Init UI.
     ui_draw::init((float)window_width, (float)window_height);
     ui::set_input_responsive(true);
@@ -49,11 +163,52 @@ int main(int argc, char **argv) {
     file_system::release_file(pixel_shader_file);
     assert(graphics::is_ready(&pixel_shader));
 
-    // List of macro defines for compute shader.
+    // List of macro defines shared by all variants of the ray tracing shader.
     char *macro_defines[] = {
         "DEFINE_SPHERES_COUNT", STR(SPHERES_COUNT),
         "GROUP_SIZE_X", STR(GROUP_SIZE_X),
-        "GROUP_SIZE_Y", STR(GROUP_SIZE_Y)
+        "GROUP_SIZE_Y", STR(GROUP_SIZE_Y),
+        "MAX_TILES_PER_DISPATCH", STR(MAX_TILES_PER_DISPATCH),
+        "FILTER_TABLE_SIZE", STR(FILTER_TABLE_SIZE),
+        "RADIANCE_CACHE_WIDTH", STR(RADIANCE_CACHE_WIDTH),
+        "RADIANCE_CACHE_ROWS", STR(RADIANCE_CACHE_ROWS),
+        "VPL_COUNT", STR(VPL_COUNT),
+        "VPL_GROUP_SIZE", STR(VPL_GROUP_SIZE)
+    };
+
+    // Function to compile a variant of the ray tracing shader, with variant's own defines appended to the shared ones.
+    auto get_ray_trace_shader = [&macro_defines](File *file, char **variant_defines, int variant_defines_count) {
+        const int MAX_VARIANT_DEFINES = 8;
+        assert(variant_defines_count <= MAX_VARIANT_DEFINES);
+        char *defines[ARRAYSIZE(macro_defines) + MAX_VARIANT_DEFINES];
+        memcpy(defines, macro_defines, sizeof(macro_defines));
+        memcpy(defines + ARRAYSIZE(macro_defines), variant_defines, variant_defines_count * sizeof(char *));
+        int defines_count = int(ARRAYSIZE(macro_defines)) + variant_defines_count;
+        return graphics::get_compute_shader_from_code((char *)file->data, file->size, defines, defines_count);
+    };
+
+    // Shader variant generating virtual point lights for instant radiosity preview.
+    char *vpl_macro_defines[] = {
+        "VPL_GENERATION", "1"
+    };
+
+    // Function to compile ray tracing shader for every camera model. Returns false if any of them failed to compile,
+    // in which case the successfully compiled ones are released.
+    auto get_ray_trace_shaders = [&get_ray_trace_shader](File *file, ComputeShader *shaders) {
+        bool success = true;
+        for(int i = 0; i < CAMERA_MODELS_COUNT; ++i) {
+            char *camera_macro_defines[] = {
+                "CAMERA_MODEL", camera::get_model_define(CameraModel(i))
+            };
+            shaders[i] = get_ray_trace_shader(file, camera_macro_defines, ARRAYSIZE(camera_macro_defines));
+            success &= graphics::is_ready(&shaders[i]);
+        }
+        if(!success) {
+            for(int i = 0; i < CAMERA_MODELS_COUNT; ++i) {
+                if(graphics::is_ready(&shaders[i])) graphics::release(&shaders[i]);
+            }
+        }
+        return success;
     };
     
     // Main raytracing shader
@@ -61,11 +216,12 @@ int main(int argc, char **argv) {
     // This is needed for hot-reloading.
     char *ray_trace_shader_path = "../ray_trace_shader.hlsl";
     File ray_trace_shader_file = file_system::read_file(ray_trace_shader_path);
-    ComputeShader ray_trace_shader = graphics::get_compute_shader_from_code(
-        (char *)ray_trace_shader_file.data, ray_trace_shader_file.size, macro_defines, ARRAYSIZE(macro_defines)
-    );
+    ComputeShader ray_trace_shaders[CAMERA_MODELS_COUNT];
+    bool ray_trace_shaders_ready = get_ray_trace_shaders(&ray_trace_shader_file, ray_trace_shaders);
+    ComputeShader vpl_shader = get_ray_trace_shader(&ray_trace_shader_file, vpl_macro_defines, ARRAYSIZE(vpl_macro_defines));
     file_system::release_file(ray_trace_shader_file);
-    assert(graphics::is_ready(&ray_trace_shader));
+    assert(ray_trace_shaders_ready);
+    assert(graphics::is_ready(&vpl_shader));
 
     // Simple texture sampler.
     TextureSampler tex_sampler = graphics::get_texture_sampler();
@@ -74,6 +230,69 @@ int main(int argc, char **argv) {
     // Texture where we'll render the scene.
     Texture2D render_texture = graphics::get_texture2D(NULL, render_target_width, render_target_height, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
     assert(graphics::is_ready(&render_texture));
+    graphics::clear_texture(&render_texture, 0.0f, 0.0f, 0.0f, 0.0f);
+
+    // Tiles are traced in batches, so a single frame doesn't have to trace the whole image.
+    const float TARGET_FRAME_TIME = 1.0f / 30.0f;
+    int tiles_x = (render_target_width + GROUP_SIZE_X - 1) / GROUP_SIZE_X;
+    int tiles_y = (render_target_height + GROUP_SIZE_Y - 1) / GROUP_SIZE_Y;
+    TileScheduler scheduler = tile_scheduler::get(&persistent_arena, tiles_x, tiles_y, TARGET_FRAME_TIME);
+
+    // Stereo renders both eyes side by side. Every thread traces the same pixel for both eyes,
+    // so only tiles of the left eye's half are scheduled. Tile lists are swapped when stereo is toggled.
+    int eye_tiles_x = (render_target_width / 2 + GROUP_SIZE_X - 1) / GROUP_SIZE_X;
+    TileScheduler other_scheduler = tile_scheduler::get(&persistent_arena, eye_tiles_x, tiles_y, TARGET_FRAME_TIME);
+
+    // Center of the image is usually the most important, so it's traced first after every reset.
+    tile_scheduler::order_by_distance(&scheduler, tiles_x * 0.5f, tiles_y * 0.5f);
+    tile_scheduler::order_by_distance(&other_scheduler, eye_tiles_x * 0.5f, tiles_y * 0.5f);
+
+    struct TilesBuffer {
+        uint32_t tiles[MAX_TILES_PER_DISPATCH];
+    };
+    ConstantBuffer tiles_buffer = graphics::get_constant_buffer(sizeof(TilesBuffer));
+
+    // Rounding error of accumulated colors, which long renders carry over from step to step.
+    Texture2D accumulation_error_texture = graphics::get_texture2D(NULL, render_target_width, render_target_height, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
+    assert(graphics::is_ready(&accumulation_error_texture));
+
+    // Bit mask of spheres touched by each pixel's paths, used for selective invalidation.
+    Texture2D dependency_texture = graphics::get_texture2D(NULL, render_target_width, render_target_height, DXGI_FORMAT_R32G32B32A32_UINT, 16);
+    assert(graphics::is_ready(&dependency_texture));
+
+    // Primary visibility computed on the CPU. It's rebuilt only when the camera, spheres or filter change.
+    VisibilityBuffer visibility_buffer = visibility::get(&persistent_arena, render_target_width, render_target_height);
+    Texture2D visibility_texture = graphics::get_texture2D(NULL, render_target_width, render_target_height, DXGI_FORMAT_R32_UINT, 4);
+    assert(graphics::is_ready(&visibility_texture));
+    Vector4 *visibility_spheres = arena::push_array<Vector4>(&persistent_arena, SPHERES_COUNT);
+    Vector3 visibility_camera_pos = Vector3(0, 0, 0);
+    int visibility_filter = -1;
+
+    // Radiance cache's hash grid, every cell takes one texel in each of 5 blocks of rows. Cells are cleared only when
+    // cache generation wraps around, otherwise generation changes, so the cells from before the last scene change
+    // are treated as empty.
+    Texture2D radiance_cache_texture = graphics::get_texture2D(NULL, RADIANCE_CACHE_WIDTH, RADIANCE_CACHE_ROWS * 5, DXGI_FORMAT_R32_UINT, 4);
+    assert(graphics::is_ready(&radiance_cache_texture));
+    auto clear_radiance_cache = [&radiance_cache_texture, &frame_arena]() {
+        size_t cache_texels = size_t(RADIANCE_CACHE_WIDTH) * RADIANCE_CACHE_ROWS * 5;
+        uint32_t *empty_cache = arena::push_array<uint32_t>(&frame_arena, cache_texels);
+        assert(empty_cache);
+        memset(empty_cache, 0, cache_texels * sizeof(uint32_t));
+        graphics::update_texture(&radiance_cache_texture, empty_cache);
+    };
+    clear_radiance_cache();
+    arena::reset(&frame_arena);
+
+    // Virtual point lights, regenerated at the start of every step while instant radiosity preview is on.
+    Texture2D vpl_texture = graphics::get_texture2D(NULL, VPL_COUNT, 3, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
+    assert(graphics::is_ready(&vpl_texture));
+
+    // Pixel reconstruction filter.
+    FilmFilter film_filter = FILTER_GAUSSIAN;
+    FilterTable filter_table;
+    film::get_filter_table(film_filter, &filter_table);
+    ConstantBuffer filter_buffer = graphics::get_constant_buffer(sizeof(FilterTable));
+    graphics::update_constant_buffer(&filter_buffer, &filter_table);
 
     // Quad mesh for rendering the resulting texture.
     Mesh quad_mesh = graphics::get_quad_mesh();
@@ -97,7 +316,34 @@ int main(int argc, char **argv) {
         float refractive_index;
         float dof_radius;
         float dof_focal_plane;
+
+        int num_samples;
+        int num_bounces;
+        int direct_light_only;
+        int dependency_tracking;
+
+        // Bit masks of spheres, one bit per sphere.
+        uint32_t edited_spheres[4];
+        uint32_t moved_spheres[4];
+
+        int scenes_per_row;
+        int stereo;
+        float eye_separation;
+        int use_visibility;
+
+        CameraBasis camera;
+
+        int radiance_cache_enabled;
+        float cache_cell_size;
+        int cache_min_samples;
+        uint32_t cache_generation;
+
+        int vpl_preview;
+        float vpl_clamp;
+        int padding[2];
     };
+    static_assert(offsetof(Config, camera) % 16 == 0, "Camera basis has to start at a new constant buffer register.");
+    static_assert(SPHERES_COUNT <= 128, "Sphere masks have only 128 bits.");
     Config config = {
         Vector3(0,0,0),
         0,
@@ -111,12 +357,24 @@ int main(int argc, char **argv) {
         1.5f,
         0.0f,
         8.0f,
+
+        32,
+        10,
+        0,
+        0,
     };
+    config.eye_separation = 0.065f;
+    config.cache_cell_size = 0.25f;
+    config.cache_min_samples = 16;
+    config.cache_generation = 1;
+    config.vpl_clamp = 0.25f;
     ConstantBuffer config_buffer = graphics::get_constant_buffer(sizeof(Config));
 
     struct SpheresBuffer {
         Vector4 positions[SPHERES_COUNT];
         Vector4 materials[SPHERES_COUNT];
+        // Per-sphere material parameters, x is metal roughness.
+        Vector4 parameters[SPHERES_COUNT];
     };
     ConstantBuffer spheres_buffer = graphics::get_constant_buffer(sizeof(SpheresBuffer));
 
@@ -128,19 +386,42 @@ int main(int argc, char **argv) {
         LIGHT = 4,
     };
 
-    // Initialize spheres.
     SpheresBuffer spheres;
-    // Ground sphere.
-    spheres.positions[0] = Vector4(0, -1000, 0, 1000);
-    spheres.materials[0] = Vector4(0.15f, 0.15f, 0.15f, LAMBERT);
 
-    // "Sun" sphere.
-    // Not used by default. To use it, loop in reset_spheres has to start from 2.
-    spheres.positions[1] = Vector4(10, 10, 0, 2);
-    spheres.materials[1] = Vector4(800.0f, 800.0f, 800.0f, LIGHT);
+    // Function to get random color for a material.
+    auto get_material_color = [](Material mat) {
+        Vector3 color = Vector3(0.9f, 0.9f, 0.9f);
+        switch (mat) {
+            case LAMBERT:
+            case LAMBERT_CHECKERBOARD: {
+                color = colors::hsv_to_rgb(math::random_uniform(180, 360), 0.9f, 1) * 0.2f;
+            }
+            break;
+            case METAL:
+            break;
+            case DIELECTRIC:
+            break;
+            case LIGHT: {
+                color = colors::hsv_to_rgb(math::random_uniform(0, 360), 0.2f, 1) * 500.0f;
+            }
+            break;
+        }
+        return color;
+    };
+
+    // Function to generate random spheres positions/colors/materials.
+    auto generate_spheres = [&get_material_color](Vector4 *positions, Vector4 *materials, Vector4 *parameters) {
+        // Ground sphere.
+        positions[0] = Vector4(0, -1000, 0, 1000);
+        materials[0] = Vector4(0.15f, 0.15f, 0.15f, LAMBERT);
+        parameters[0] = Vector4(0, 0, 0, 0);
+
+        // "Sun" sphere.
+        // Not used by default. To use it, the loop below has to start from 2.
+        positions[1] = Vector4(10, 10, 0, 2);
+        materials[1] = Vector4(800.0f, 800.0f, 800.0f, LIGHT);
+        parameters[1] = Vector4(0, 0, 0, 0);
 
-    // Function to reset spheres positions/colors/materials.
-    auto reset_spheres = [&spheres, &spheres_buffer]() {
         const float SPHERES_CIRCLE_RADIUS = 15.0f;
         for(int i = 1; i < SPHERES_COUNT; ++i) {
             float sphere_size = math::random_uniform(0.5f, 1.0f);
@@ -159,7 +440,7 @@ int main(int argc, char **argv) {
                 // Check for collisions.
                 collision = false;
                 for(int j = 1; j < i; j++) {
-                    Vector4 other_sphere = spheres.positions[j];
+                    Vector4 other_sphere = positions[j];
                     Vector2 other_sphere_pos = Vector2(other_sphere.x, other_sphere.z);
                     if(math::length(other_sphere_pos - current_pos) < other_sphere.w + sphere_size) {
                         collision = true;
@@ -167,7 +448,7 @@ int main(int argc, char **argv) {
                     }
                 }
             } while(collision);
-            spheres.positions[i] = Vector4(x, sphere_size, z, sphere_size);
+            positions[i] = Vector4(x, sphere_size, z, sphere_size);
 
             // Map from index (random number) to material.
             // We want lambertian materials to be more probable, so they're represented twice in the map.
@@ -182,41 +463,478 @@ int main(int argc, char **argv) {
             };
             Material mat = index_to_mat[int(math::random_uniform(0, ARRAYSIZE(index_to_mat)))];
 
-            // Get sphere's color.
-            Vector3 color = Vector3(0.9f, 0.9f, 0.9f);
-            switch (mat) {
-                case LAMBERT:
-                case LAMBERT_CHECKERBOARD: {
-                    color = colors::hsv_to_rgb(math::random_uniform(180, 360), 0.9f, 1) * 0.2f;
-                }
-                break;
-                case METAL:
-                break;
-                case DIELECTRIC:
-                break;
-                case LIGHT: {
-                    color = colors::hsv_to_rgb(math::random_uniform(0, 360), 0.2f, 1) * 500.0f;
-                }
-                break;
-            }
-            spheres.materials[i] = Vector4(color, float(mat));
+            materials[i] = Vector4(get_material_color(mat), float(mat));
+            parameters[i] = Vector4(math::random_uniform(), 0, 0, 0);
         }
+    };
+
+    // Function to reset spheres positions/colors/materials.
+    auto reset_spheres = [&spheres, &spheres_buffer, &generate_spheres]() {
+        generate_spheres(spheres.positions, spheres.materials, spheres.parameters);
         // Update constant buffer with new spheres.
         graphics::update_constant_buffer(&spheres_buffer, &spheres);
     };
 
+    // Spheres edited since the current step started. They're applied in the next step,
+    // which has to run over all the tiles, so we know that every dependent pixel was invalidated.
+    uint32_t pending_edits[4] = {};
+    // Spheres moved since the current step started, applied the same way. Only the step that applies a move
+    // checks for pixels reaching the sphere for the first time, later steps already saw it at the new place.
+    uint32_t pending_moves[4] = {};
+
     // Function to reset rendering state.
-    auto reset_rendering = [&config, &render_texture]() {
-        graphics::clear_texture(&render_texture, 0.0f, 0.0f, 0.0f, 0.0f);
-        config.step = 1;
+    // Render texture isn't cleared, first step overwrites it tile by tile, so we never display an empty frame.
+    auto reset_rendering = [&config, &scheduler, &pending_edits, &pending_moves]() {
+        tile_scheduler::invalidate(&scheduler);
+        config.step = 0;
+        for(int i = 0; i < 4; ++i) {
+            config.edited_spheres[i] = 0;
+            config.moved_spheres[i] = 0;
+            pending_edits[i] = 0;
+            pending_moves[i] = 0;
+        }
+    };
+
+    // Function to invalidate radiance cache after scene change. Generation is stored in keys' lowest byte, which can't be zero.
+    // Once the byte wraps around, cells left from 255 generations ago would match again, so the whole cache is cleared.
+    auto invalidate_radiance_cache = [&config, &clear_radiance_cache]() {
+        config.cache_generation++;
+        if ((config.cache_generation & 0xFF) == 0) {
+            config.cache_generation++;
+            clear_radiance_cache();
+        }
+    };
+
+    // Function to apply change of a single sphere. With dependency tracking enabled, we restart accumulation
+    // only in pixels that depend on the sphere. Otherwise the whole image has to be reset.
+    auto edit_sphere = [&config, &scheduler, &pending_edits, &pending_moves, &spheres, &spheres_buffer, &reset_rendering](int index, bool moved) {
+        graphics::update_constant_buffer(&spheres_buffer, &spheres);
+        // VPLs light the whole scene, so with instant radiosity any edit can change any pixel. Paths ending on radiance
+        // cache hits don't record spheres the cached radiance came from, so their dependencies are incomplete too.
+        if (!config.dependency_tracking || config.vpl_preview || config.radiance_cache_enabled) {
+            reset_rendering();
+            return;
+        }
+
+        // Edits from the interrupted step weren't applied to all the tiles yet, so they're carried over.
+        for(int i = 0; i < 4; ++i) {
+            pending_edits[i] |= config.edited_spheres[i];
+            pending_moves[i] |= config.moved_spheres[i];
+        }
+        uint32_t sphere_bit = 1u << (index % 32);
+        pending_edits[index / 32] |= sphere_bit;
+        // Moved sphere can affect pixels which never touched it before, shader handles these separately.
+        if (moved) {
+            pending_moves[index / 32] |= sphere_bit;
+        }
+        tile_scheduler::invalidate(&scheduler);
+    };
+
+    // Rendering quality stages. While the user interacts with the scene we render with the lowest quality,
+    // so the image responds immediately. Once the input stops, quality ramps up stage by stage.
+    struct QualityStage {
+        int num_samples;
+        int num_bounces;
+        bool direct_light_only;
+        float duration;
+    };
+    const QualityStage QUALITY_STAGES[] = {
+        {  1,  2, true,  0.3f }, // Interaction, duration is the idle timeout.
+        {  4,  4, false, 0.3f },
+        { 16,  6, false, 0.5f },
+        { 32, 10, false, 0.0f }, // Full quality, stays until the next interaction.
+    };
+    const int QUALITY_STAGES_COUNT = ARRAYSIZE(QUALITY_STAGES);
+    int quality_stage = QUALITY_STAGES_COUNT - 1;
+    float quality_stage_time = 0.0f;
+
+    // Function to switch rendering quality. Number of bounces changes the image, so we have to restart accumulation.
+    auto set_quality_stage = [&QUALITY_STAGES, &quality_stage, &quality_stage_time, &config, &reset_rendering](int stage) {
+        quality_stage = stage;
+        quality_stage_time = 0.0f;
+        config.num_samples = QUALITY_STAGES[stage].num_samples;
+        config.num_bounces = QUALITY_STAGES[stage].num_bounces;
+        config.direct_light_only = QUALITY_STAGES[stage].direct_light_only;
+        reset_rendering();
     };
 
     // Initialize spheres for the first time.
     reset_spheres();
 
+    // Function to write out image from mapped readback texture. Image is encoded into writer's buffer,
+    // so the readback can be unmapped while the write is still in flight.
+    auto write_image = [](AsyncWriter *writer, char *path, float *data, int width, int height, int row_pitch) {
+        uint8_t *image_data = async_io::get_buffer(writer);
+        size_t image_size = image::encode_ppm(image_data, data, width, height, row_pitch);
+        async_io::write_file(writer, image_data, image_size, path);
+    };
+
+    // Batch rendering.
+    // Scenes are rendered in groups. All scenes in a group are laid out in a grid inside one atlas texture
+    // and their tiles are traced together by the same dispatches, so even tiny images keep the GPU busy.
+    // While GPU renders a group, CPU writes out the previous one.
+    if(batch_scenes_count > 0) {
+        static_assert(GROUP_SIZE_X == GROUP_SIZE_Y, "Batch scenes have to consist of square tiles.");
+        const int SAMPLES_PER_STEP = 32;
+        int scene_size = (batch_scene_size + GROUP_SIZE_X - 1) / GROUP_SIZE_X * GROUP_SIZE_X;
+        int scene_tiles = scene_size / GROUP_SIZE_X;
+        int scenes_per_row = 1;
+        while(scenes_per_row * scenes_per_row < BATCH_SCENES) scenes_per_row++;
+        int scenes_rows = (BATCH_SCENES + scenes_per_row - 1) / scenes_per_row;
+        int steps_count = (samples_count + SAMPLES_PER_STEP - 1) / SAMPLES_PER_STEP;
+        int groups_count = (batch_scenes_count + BATCH_SCENES - 1) / BATCH_SCENES;
+
+        // Shader variant which reads spheres of the scene the pixel belongs to.
+        char *batch_macro_defines[] = {
+            "BATCH_SCENES", STR(BATCH_SCENES),
+            "CAMERA_MODEL", camera::get_model_define(CAMERA_THIN_LENS)
+        };
+        File batch_shader_file = file_system::read_file(ray_trace_shader_path);
+        ComputeShader batch_shader = get_ray_trace_shader(&batch_shader_file, batch_macro_defines, ARRAYSIZE(batch_macro_defines));
+        file_system::release_file(batch_shader_file);
+        assert(graphics::is_ready(&batch_shader));
+
+        // Two groups are in flight, one being rendered and one being written out.
+        struct BatchSpheresBuffer {
+            Vector4 positions[SPHERES_COUNT * BATCH_SCENES];
+            Vector4 materials[SPHERES_COUNT * BATCH_SCENES];
+            Vector4 parameters[SPHERES_COUNT * BATCH_SCENES];
+        };
+        static_assert(sizeof(BatchSpheresBuffer) <= 65536, "Spheres of all batch scenes have to fit into a constant buffer.");
+        ConstantBuffer batch_spheres_buffer = graphics::get_constant_buffer(sizeof(BatchSpheresBuffer));
+        BatchSpheresBuffer *batch_spheres = arena::push_array<BatchSpheresBuffer>(&persistent_arena, 2);
+        Texture2D atlases[2];
+        ReadbackTexture atlas_readbacks[2];
+        for(int i = 0; i < 2; ++i) {
+            atlases[i] = graphics::get_texture2D(NULL, scenes_per_row * scene_size, scenes_rows * scene_size, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
+            assert(graphics::is_ready(&atlases[i]));
+            atlas_readbacks[i] = readback::get(&atlases[i]);
+        }
+        // Tiles of the group's scenes. Grid's last row might not be full and the last group might not have all the scenes,
+        // empty cells are never traced.
+        uint32_t *group_tiles = arena::push_array<uint32_t>(&persistent_arena, BATCH_SCENES * scene_tiles * scene_tiles);
+        assert(group_tiles);
+        TilesBuffer *batch_tiles_data = arena::push_array<TilesBuffer>(&persistent_arena, 1);
+
+        // Writes of one group can be in flight while the next group is written out.
+        AsyncWriter image_writer = async_io::get(BATCH_SCENES * 2, image::get_ppm_size(scene_size, scene_size), sync_io);
+
+        Config batch_config = config;
+        batch_config.camera_pos = camera::get_orbit_position(azimuth, polar, radius);
+        batch_config.camera = camera::get_basis(batch_config.camera_pos, 1.0f, CAMERA_THIN_LENS);
+        batch_config.render_target_width = scene_size;
+        batch_config.render_target_height = scene_size;
+        batch_config.num_samples = SAMPLES_PER_STEP;
+        batch_config.scenes_per_row = scenes_per_row;
+
+        // Scene metadata is streamed as one JSON object per line, next to the images.
+        CreateDirectoryA(output_path, NULL);
+        char path_buffer[256];
+        sprintf_s(path_buffer, 256, "%s/scenes.jsonl", output_path);
+        FILE *metadata_file = fopen(path_buffer, "w");
+        assert(metadata_file);
+
+        Timer batch_timer = timer::get();
+        timer::start(&batch_timer);
+        for(int group = 0; group <= groups_count; ++group) {
+            // Render current group.
+            if(group < groups_count) {
+                int slot = group % 2;
+                int group_scenes_count = batch_scenes_count - group * BATCH_SCENES;
+                if(group_scenes_count > BATCH_SCENES) group_scenes_count = BATCH_SCENES;
+                BatchSpheresBuffer *group_spheres = &batch_spheres[slot];
+                for(int i = 0; i < group_scenes_count; ++i) {
+                    generate_spheres(
+                        &group_spheres->positions[i * SPHERES_COUNT],
+                        &group_spheres->materials[i * SPHERES_COUNT],
+                        &group_spheres->parameters[i * SPHERES_COUNT]
+                    );
+                }
+                graphics::update_constant_buffer(&batch_spheres_buffer, group_spheres);
+
+                graphics::set_compute_shader(&batch_shader);
+                graphics::set_constant_buffer(&config_buffer, 0);
+                graphics::set_constant_buffer(&batch_spheres_buffer, 1);
+                graphics::set_constant_buffer(&tiles_buffer, 2);
+                graphics::set_constant_buffer(&filter_buffer, 4);
+                graphics::set_texture_compute(&atlases[slot], 0);
+                int group_tiles_count = 0;
+                for(int i = 0; i < group_scenes_count; ++i) {
+                    int cell_x = (i % scenes_per_row) * scene_tiles;
+                    int cell_y = (i / scenes_per_row) * scene_tiles;
+                    for(int y = 0; y < scene_tiles; ++y) {
+                        for(int x = 0; x < scene_tiles; ++x) {
+                            group_tiles[group_tiles_count++] = uint32_t(cell_x + x) | (uint32_t(cell_y + y) << 16);
+                        }
+                    }
+                }
+                for(int step = 1; step <= steps_count; ++step) {
+                    batch_config.step = step;
+                    graphics::update_constant_buffer(&config_buffer, &batch_config);
+                    for(int first_tile = 0; first_tile < group_tiles_count; first_tile += MAX_TILES_PER_DISPATCH) {
+                        int tiles_count = group_tiles_count - first_tile;
+                        if(tiles_count > MAX_TILES_PER_DISPATCH) tiles_count = MAX_TILES_PER_DISPATCH;
+                        memcpy(batch_tiles_data->tiles, group_tiles + first_tile, tiles_count * sizeof(uint32_t));
+                        graphics::update_constant_buffer(&tiles_buffer, batch_tiles_data);
+                        graphics::run_compute(tiles_count, 1, 1);
+                    }
+                }
+                graphics::unset_texture_compute(0);
+                readback::copy(&atlas_readbacks[slot], &atlases[slot]);
+            }
+
+            // Write out previous group.
+            if(group > 0) {
+                int slot = (group - 1) % 2;
+                float *atlas_data;
+                int row_pitch;
+                bool mapped = readback::map(&atlas_readbacks[slot], (void **)&atlas_data, &row_pitch, true);
+                assert(mapped);
+
+                BatchSpheresBuffer *group_spheres = &batch_spheres[slot];
+                for(int i = 0; i < BATCH_SCENES; ++i) {
+                    int scene_index = (group - 1) * BATCH_SCENES + i;
+                    if(scene_index >= batch_scenes_count) break;
+
+                    // Image.
+                    int scene_x = (i % scenes_per_row) * scene_size;
+                    int scene_y = (i / scenes_per_row) * scene_size;
+                    float *scene_data = (float *)((uint8_t *)atlas_data + scene_y * row_pitch) + scene_x * 4;
+                    sprintf_s(path_buffer, 256, "%s/scene_%06d.ppm", output_path, scene_index);
+                    write_image(&image_writer, path_buffer, scene_data, scene_size, scene_size, row_pitch);
+
+                    // Metadata.
+                    Vector3 camera_pos = batch_config.camera_pos;
+                    fprintf(metadata_file, "{\"image\": \"scene_%06d.ppm\", \"camera\": [%f, %f, %f], \"spheres\": [",
+                            scene_index, camera_pos.x, camera_pos.y, camera_pos.z);
+                    for(int j = 0; j < SPHERES_COUNT; ++j) {
+                        Vector4 position = group_spheres->positions[i * SPHERES_COUNT + j];
+                        Vector4 material = group_spheres->materials[i * SPHERES_COUNT + j];
+                        Vector4 parameters = group_spheres->parameters[i * SPHERES_COUNT + j];
+                        fprintf(metadata_file, "%s[%f, %f, %f, %f, %f, %f, %f, %d, %f]", j > 0 ? ", " : "",
+                                position.x, position.y, position.z, position.w, material.x, material.y, material.z, int(material.w), parameters.x);
+                    }
+                    fprintf(metadata_file, "]}\n");
+                }
+                readback::unmap(&atlas_readbacks[slot]);
+                arena::reset(&frame_arena);
+            }
+        }
+        fclose(metadata_file);
+        async_io::wait_all(&image_writer);
+
+        float batch_time = timer::checkpoint(&batch_timer);
+        printf("Rendered %d scenes in %.2f s, %.0f images per hour.\n",
+               batch_scenes_count, batch_time, float(batch_scenes_count) / batch_time * 3600.0f);
+        printf("%s writes, %.2f s spent blocked on them.\n", sync_io ? "Blocking" : "Asynchronous", image_writer.wait_time);
+        async_io::release(&image_writer);
+
+        for(int i = 0; i < 2; ++i) {
+            readback::release(&atlas_readbacks[i]);
+        }
+        graphics::release(&batch_shader);
+        graphics::release();
+        return 0;
+    }
+
+    // Parameter sweep.
+    // All variants are traced by the same threads, sample by sample, so they converge together.
+    // When the swept parameter doesn't affect primary rays, variants also share primary rays and their hits.
+    if(sweep_variants_count > 0) {
+        sweep_variants_count = sweep_variants_count < SWEEP_MAX_VARIANTS ? sweep_variants_count : SWEEP_MAX_VARIANTS;
+        const int SAMPLES_PER_STEP = 4;
+        int steps_count = (samples_count + SAMPLES_PER_STEP - 1) / SAMPLES_PER_STEP;
+        int variants_per_row = 1;
+        while(variants_per_row * variants_per_row < sweep_variants_count) variants_per_row++;
+        int variants_rows = (sweep_variants_count + variants_per_row - 1) / variants_per_row;
+
+        // Constant buffer with parameters of all variants.
+        struct SweepBuffer {
+            // Ambient light intensity, sphere lights intensity, metal roughness, refractive index.
+            Vector4 variant_shading[SWEEP_MAX_VARIANTS];
+            // Depth of field radius and focal plane.
+            Vector4 variant_lens[SWEEP_MAX_VARIANTS];
+            int variants_count;
+            int variants_per_row;
+            int share_primary_rays;
+            int padding;
+        };
+        SweepBuffer sweep = {};
+        sweep.variants_count = sweep_variants_count;
+        sweep.variants_per_row = variants_per_row;
+        sweep.share_primary_rays = 1;
+        for(int i = 0; i < sweep_variants_count; ++i) {
+            Config variant = config;
+            float t = sweep_variants_count > 1 ? float(i) / float(sweep_variants_count - 1) : 0.0f;
+            float value = sweep_from + (sweep_to - sweep_from) * t;
+            if(strcmp(sweep_parameter, "ambient_light_intensity") == 0) variant.ambient_light_intensity = value;
+            else if(strcmp(sweep_parameter, "sphere_lights_intensity") == 0) variant.sphere_lights_intensity = value;
+            else if(strcmp(sweep_parameter, "metal_roughness") == 0) variant.metal_roughness = value;
+            else if(strcmp(sweep_parameter, "refractive_index") == 0) variant.refractive_index = value;
+            else if(strcmp(sweep_parameter, "dof_radius") == 0) variant.dof_radius = value;
+            else if(strcmp(sweep_parameter, "dof_focal_plane") == 0) variant.dof_focal_plane = value;
+            else {
+                printf("Unknown sweep parameter %s.\n", sweep_parameter);
+                return 1;
+            }
+
+            sweep.variant_shading[i] = Vector4(variant.ambient_light_intensity, variant.sphere_lights_intensity, variant.metal_roughness, variant.refractive_index);
+            sweep.variant_lens[i] = Vector4(variant.dof_radius, variant.dof_focal_plane, 0.0f, 0.0f);
+        }
+        if(strcmp(sweep_parameter, "dof_radius") == 0 || strcmp(sweep_parameter, "dof_focal_plane") == 0) {
+            sweep.share_primary_rays = 0;
+        }
+        ConstantBuffer sweep_buffer = graphics::get_constant_buffer(sizeof(SweepBuffer));
+        graphics::update_constant_buffer(&sweep_buffer, &sweep);
+
+        // Shader variant tracing all the variants at once.
+        char *sweep_macro_defines[] = {
+            "SWEEP_MAX_VARIANTS", STR(SWEEP_MAX_VARIANTS),
+            "CAMERA_MODEL", camera::get_model_define(CAMERA_THIN_LENS)
+        };
+        File sweep_shader_file = file_system::read_file(ray_trace_shader_path);
+        ComputeShader sweep_shader = get_ray_trace_shader(&sweep_shader_file, sweep_macro_defines, ARRAYSIZE(sweep_macro_defines));
+        file_system::release_file(sweep_shader_file);
+        assert(graphics::is_ready(&sweep_shader));
+
+        // Contact sheet with all the variants in a grid.
+        int sheet_width = variants_per_row * render_target_width;
+        int sheet_height = variants_rows * render_target_height;
+        Texture2D sheet_texture = graphics::get_texture2D(NULL, sheet_width, sheet_height, DXGI_FORMAT_R32G32B32A32_FLOAT, 16);
+        assert(graphics::is_ready(&sheet_texture));
+        graphics::clear_texture(&sheet_texture, 0.0f, 0.0f, 0.0f, 0.0f);
+        ReadbackTexture sheet_readback = readback::get(&sheet_texture);
+        TilesBuffer *sweep_tiles_data = arena::push_array<TilesBuffer>(&persistent_arena, 1);
+
+        Config sweep_config = config;
+        sweep_config.camera_pos = camera::get_orbit_position(azimuth, polar, radius);
+        sweep_config.camera = camera::get_basis(sweep_config.camera_pos, float(render_target_width) / float(render_target_height), CAMERA_THIN_LENS);
+        sweep_config.num_samples = SAMPLES_PER_STEP;
+
+        Timer sweep_timer = timer::get();
+        timer::start(&sweep_timer);
+        graphics::set_compute_shader(&sweep_shader);
+        graphics::set_constant_buffer(&config_buffer, 0);
+        graphics::set_constant_buffer(&spheres_buffer, 1);
+        graphics::set_constant_buffer(&tiles_buffer, 2);
+        graphics::set_constant_buffer(&sweep_buffer, 3);
+        graphics::set_constant_buffer(&filter_buffer, 4);
+        graphics::set_texture_compute(&sheet_texture, 0);
+        for(int step = 1; step <= steps_count; ++step) {
+            sweep_config.step = step;
+            graphics::update_constant_buffer(&config_buffer, &sweep_config);
+            int traced_tiles = 0;
+            while(traced_tiles < scheduler.tiles_count) {
+                TileBatch batch = tile_scheduler::next_batch(&scheduler, MAX_TILES_PER_DISPATCH);
+                memcpy(sweep_tiles_data->tiles, batch.tiles, batch.tiles_count * sizeof(uint32_t));
+                graphics::update_constant_buffer(&tiles_buffer, sweep_tiles_data);
+                graphics::run_compute(batch.tiles_count, 1, 1);
+                traced_tiles += batch.tiles_count;
+            }
+        }
+        graphics::unset_texture_compute(0);
+        readback::copy(&sheet_readback, &sheet_texture);
+
+        float *sheet_data;
+        int row_pitch;
+        bool mapped = readback::map(&sheet_readback, (void **)&sheet_data, &row_pitch, true);
+        assert(mapped);
+        float sweep_time = timer::checkpoint(&sweep_timer);
+
+        // Contact sheet, individual images and list of variants' values.
+        CreateDirectoryA(output_path, NULL);
+        char path_buffer[256];
+        AsyncWriter image_writer = async_io::get(2, image::get_ppm_size(sheet_width, sheet_height), sync_io);
+        sprintf_s(path_buffer, 256, "%s/contact_sheet.ppm", output_path);
+        write_image(&image_writer, path_buffer, sheet_data, sheet_width, sheet_height, row_pitch);
+
+        sprintf_s(path_buffer, 256, "%s/variants.jsonl", output_path);
+        FILE *variants_file = fopen(path_buffer, "w");
+        assert(variants_file);
+        for(int i = 0; i < sweep_variants_count; ++i) {
+            int variant_x = (i % variants_per_row) * render_target_width;
+            int variant_y = (i / variants_per_row) * render_target_height;
+            float *variant_data = (float *)((uint8_t *)sheet_data + variant_y * row_pitch) + variant_x * 4;
+            sprintf_s(path_buffer, 256, "%s/variant_%02d.ppm", output_path, i);
+            write_image(&image_writer, path_buffer, variant_data, render_target_width, render_target_height, row_pitch);
+
+            Vector4 shading = sweep.variant_shading[i];
+            Vector4 lens = sweep.variant_lens[i];
+            fprintf(variants_file, "{\"image\": \"variant_%02d.ppm\", \"ambient_light_intensity\": %f, \"sphere_lights_intensity\": %f, "
+                    "\"metal_roughness\": %f, \"refractive_index\": %f, \"dof_radius\": %f, \"dof_focal_plane\": %f}\n",
+                    i, shading.x, shading.y, shading.z, shading.w, lens.x, lens.y);
+        }
+        fclose(variants_file);
+        readback::unmap(&sheet_readback);
+        async_io::release(&image_writer);
+
+        printf("Rendered %d variants with %d samples in %.2f s.\n", sweep_variants_count, steps_count * SAMPLES_PER_STEP, sweep_time);
+
+        readback::release(&sheet_readback);
+        graphics::release(&sweep_shader);
+        graphics::release();
+        return 0;
+    }
+
+    // Frames for out-of-process viewers and preview stream. Render texture is copied at the end of the frame and
+    // used once the copy is done, which is usually the next frame, so neither of them stalls the GPU.
+    FrameRing frame_ring = {};
+    TileStream stream = {};
+    bool streaming = stream_port > 0;
+    ReadbackTexture frame_readback = {};
+    bool frame_readback_pending = false;
+    int frame_readback_step = 0;
+    if(publish_frames) {
+        frame_ring = frame_ring::get(render_target_width, render_target_height, 3);
+        if(!frame_ring.memory) {
+            printf("Can't create %s, is another renderer running? Frames won't be published.\n", FRAME_RING_NAME);
+            publish_frames = false;
+        }
+    }
+    if(streaming) {
+        if(!tile_stream::get(&stream, &persistent_arena, stream_port, render_target_width, render_target_height, GROUP_SIZE_X)) {
+            printf("Can't listen on port %d, is it already in use? Stream is disabled.\n", stream_port);
+            streaming = false;
+        }
+    }
+    if(publish_frames || streaming) {
+        frame_readback = readback::get(&render_texture);
+    }
+
     // Render loop
     bool is_running = true;
     bool show_ui = true;
+    bool is_interacting = false;
+    bool panorama = false;
+    bool orthographic = false;
+    float selected_sphere = 1.0f;
+    float cache_min_samples = float(config.cache_min_samples);
+
+    // Render region, as fractions of the image (single eye's image in stereo).
+    bool render_region = false;
+    Vector4 region = Vector4(0.25f, 0.25f, 0.75f, 0.75f);
+
+    // Function to restrict steps to tiles overlapping the render region, or to trace all tiles if it's disabled.
+    auto apply_region = [&render_region, &region, &scheduler, &config, tiles_x, tiles_y, eye_tiles_x]() {
+        if(!render_region) {
+            tile_scheduler::clear_region(&scheduler);
+            return;
+        }
+        int grid_x = config.stereo ? eye_tiles_x : tiles_x;
+        int x0 = int(math::floor(math::min(region.x, region.z) * grid_x));
+        int y0 = int(math::floor(math::min(region.y, region.w) * tiles_y));
+        int x1 = int(math::ceil(math::max(region.x, region.z) * grid_x));
+        int y1 = int(math::ceil(math::max(region.y, region.w) * tiles_y));
+        tile_scheduler::set_region(&scheduler, x0, y0, math::max(x1, x0 + 1), math::max(y1, y0 + 1));
+    };
+
+    // Function to make every step trace tiles closest to given point on the film first, so the part of the image
+    // the user looks at updates first. Film position is in fractions of the image (single eye's image in stereo).
+    bool tiles_focused = false;
+    auto order_tiles = [&scheduler, &config, tiles_x, tiles_y, eye_tiles_x](Vector2 film) {
+        int grid_x = config.stereo ? eye_tiles_x : tiles_x;
+        tile_scheduler::order_by_distance(&scheduler, film.x * grid_x, film.y * tiles_y);
+    };
     FILETIME stored_file_time;
 
     Timer timer = timer::get();
@@ -226,8 +944,7 @@ int main(int argc, char **argv) {
         float dt = timer::checkpoint(&timer);
         int fps = int(1.0f / dt);
 
-        // Update ray tracing step.
-        config.step += 1;
+        arena::reset(&frame_arena);
     
         // Event loop
         {
@@ -254,6 +971,40 @@ int main(int argc, char **argv) {
             if (input::key_pressed(KeyCode::F2)) {
                 reset_rendering();   
                 reset_spheres();
+                invalidate_radiance_cache();
+            }
+            if (input::key_pressed(KeyCode::F3)) {
+                config.dependency_tracking = !config.dependency_tracking;
+                reset_rendering();
+            }
+            if (input::key_pressed(KeyCode::F4)) {
+                config.stereo = !config.stereo;
+                config.render_target_width = config.stereo ? int(render_target_width / 2) : int(render_target_width);
+                tile_scheduler::swap_tiles(&scheduler, &other_scheduler);
+                order_tiles(Vector2(0.5f, 0.5f));
+                tiles_focused = false;
+                apply_region();
+                reset_rendering();
+            }
+            if (input::key_pressed(KeyCode::F5)) {
+                panorama = !panorama;
+                reset_rendering();
+            }
+            if (input::key_pressed(KeyCode::F6)) {
+                orthographic = !orthographic;
+                reset_rendering();
+            }
+            if (input::key_pressed(KeyCode::F7)) {
+                config.radiance_cache_enabled = !config.radiance_cache_enabled;
+                reset_rendering();
+            }
+            if (input::key_pressed(KeyCode::F8)) {
+                config.vpl_preview = !config.vpl_preview;
+                reset_rendering();
+            }
+            if (input::key_pressed(KeyCode::F9)) {
+                render_region = !render_region;
+                apply_region();
             }
 
             // Handle mouse wheel scrolling.
@@ -261,6 +1012,13 @@ int main(int argc, char **argv) {
             if(math::abs(scroll_delta) > 0.0f) {
                 radius -= input::mouse_scroll_delta() * 0.1f;
                 reset_rendering();
+                is_interacting = true;
+            }
+
+            // Whole image changes with the camera, so tiles go back to center-out order.
+            if (tiles_focused && (math::abs(scroll_delta) > 0.0f || input::mouse_left_button_down())) {
+                order_tiles(Vector2(0.5f, 0.5f));
+                tiles_focused = false;
             }
 
             // Handle mouse movement.
@@ -273,17 +1031,40 @@ int main(int argc, char **argv) {
                 polar = math::clamp(polar, 0.02f, math::PI);  // Clamp so we cannot look completely along y-axis.
 
                 reset_rendering();   
+                is_interacting = true;
             }
         }
 
-        // Update camera position.
+        // Update rendering quality.
         {
-            Vector3 camera_pos = Vector3(
-                math::sin(azimuth) * math::sin(polar),
-                math::cos(polar),
-                math::cos(azimuth) * math::sin(polar)
-            ) * radius;
-            config.camera_pos = camera_pos;
+            quality_stage_time += dt;
+            if (is_interacting) {
+                if (quality_stage != 0) set_quality_stage(0);
+                quality_stage_time = 0.0f;
+            } else if (quality_stage < QUALITY_STAGES_COUNT - 1 && quality_stage_time >= QUALITY_STAGES[quality_stage].duration) {
+                set_quality_stage(quality_stage + 1);
+            }
+            is_interacting = false;
+        }
+
+        // Update camera.
+        CameraModel camera_model = camera::get_model(panorama, orthographic, config.dof_radius);
+        config.camera_pos = camera::get_orbit_position(azimuth, polar, radius);
+        config.camera = camera::get_basis(config.camera_pos, float(config.render_target_width) / float(config.render_target_height), camera_model);
+
+        // Update visibility buffer if primary rays changed.
+        config.use_visibility = camera_model == CAMERA_PINHOLE && !config.stereo;
+        if (config.use_visibility) {
+            bool camera_changed = visibility_camera_pos.x != config.camera_pos.x || visibility_camera_pos.y != config.camera_pos.y ||
+                                  visibility_camera_pos.z != config.camera_pos.z;
+            bool spheres_changed = memcmp(visibility_spheres, spheres.positions, sizeof(spheres.positions)) != 0;
+            if (camera_changed || spheres_changed || visibility_filter != int(film_filter)) {
+                visibility::build(&visibility_buffer, spheres.positions, SPHERES_COUNT, config.camera_pos, &config.camera, film::get_filter_radius(film_filter));
+                graphics::update_texture(&visibility_texture, visibility_buffer.pixels);
+                visibility_camera_pos = config.camera_pos;
+                memcpy(visibility_spheres, spheres.positions, sizeof(spheres.positions));
+                visibility_filter = int(film_filter);
+            }
         }
 
         // Shader hot reloading.
@@ -296,17 +1077,25 @@ int main(int argc, char **argv) {
             if (CompareFileTime(&current_file_time, &stored_file_time) != 0) {
                 // Try to compile the new shader.
                 File ray_trace_shader_file = file_system::read_file(reload_shader_file);
-                ComputeShader new_ray_trace_shader = graphics::get_compute_shader_from_code(
-                    (char *)ray_trace_shader_file.data, ray_trace_shader_file.size, macro_defines, ARRAYSIZE(macro_defines))
-                ;
+                ComputeShader new_ray_trace_shaders[CAMERA_MODELS_COUNT];
+                bool reload_success = get_ray_trace_shaders(&ray_trace_shader_file, new_ray_trace_shaders);
+                ComputeShader new_vpl_shader = get_ray_trace_shader(&ray_trace_shader_file, vpl_macro_defines, ARRAYSIZE(vpl_macro_defines));
                 file_system::release_file(ray_trace_shader_file);
                 
-                // If the compilation was successful, release the old shader and replace with the new one.
-                bool reload_success = graphics::is_ready(&new_ray_trace_shader);
-                if(reload_success) {
-                    graphics::release(&ray_trace_shader);
-                    ray_trace_shader = new_ray_trace_shader;
+                // If the compilation was successful, release the old shaders and replace them with the new ones.
+                if(reload_success && graphics::is_ready(&new_vpl_shader)) {
+                    for(int i = 0; i < CAMERA_MODELS_COUNT; ++i) {
+                        graphics::release(&ray_trace_shaders[i]);
+                        ray_trace_shaders[i] = new_ray_trace_shaders[i];
+                    }
+                    graphics::release(&vpl_shader);
+                    vpl_shader = new_vpl_shader;
                     reset_rendering();
+                } else {
+                    if(reload_success) {
+                        for(int i = 0; i < CAMERA_MODELS_COUNT; ++i) graphics::release(&new_ray_trace_shaders[i]);
+                    }
+                    if(graphics::is_ready(&new_vpl_shader)) graphics::release(&new_vpl_shader);
                 }
 
                 // Remember the current shader's write time.
@@ -315,13 +1104,76 @@ int main(int argc, char **argv) {
         }
 
         // Ray tracing.
-        graphics::set_compute_shader(&ray_trace_shader);
-        graphics::set_constant_buffer(&spheres_buffer, 1);
-        graphics::set_constant_buffer(&config_buffer, 0);
-        graphics::update_constant_buffer(&config_buffer, &config);
-        graphics::set_texture_compute(&render_texture, 0);
-        graphics::run_compute(render_target_width / int(GROUP_SIZE_X), render_target_height / int(GROUP_SIZE_Y), 1);
-        graphics::unset_texture_compute(0);
+        {
+            graphics::set_compute_shader(&ray_trace_shaders[camera_model]);
+            graphics::set_constant_buffer(&config_buffer, 0);
+            graphics::set_constant_buffer(&spheres_buffer, 1);
+            graphics::set_constant_buffer(&tiles_buffer, 2);
+            graphics::set_constant_buffer(&filter_buffer, 4);
+            graphics::set_texture_compute(&render_texture, 0);
+            graphics::set_texture_compute(&dependency_texture, 1);
+            graphics::set_texture_compute(&visibility_texture, 2);
+            graphics::set_texture_compute(&radiance_cache_texture, 3);
+            graphics::set_texture_compute(&vpl_texture, 4);
+            graphics::set_texture_compute(&accumulation_error_texture, 5);
+
+            // Trace as many tiles as fits into this frame's budget. Tile's cost is roughly proportional to number of rays.
+            tile_scheduler::update_budget(&scheduler, dt);
+            int tiles_budget = tile_scheduler::get_frame_budget(&scheduler, float(config.num_samples * config.num_bounces));
+            TilesBuffer *tiles_data = arena::push_array<TilesBuffer>(&frame_arena, 1);
+            while(tiles_budget > 0) {
+                int max_batch_tiles = tiles_budget < MAX_TILES_PER_DISPATCH ? tiles_budget : MAX_TILES_PER_DISPATCH;
+                TileBatch batch = tile_scheduler::next_batch(&scheduler, max_batch_tiles);
+                if(batch.starts_step) {
+                    config.step += 1;
+                    for(int i = 0; i < 4; ++i) {
+                        config.edited_spheres[i] = pending_edits[i];
+                        config.moved_spheres[i] = pending_moves[i];
+                        pending_edits[i] = 0;
+                        pending_moves[i] = 0;
+                    }
+                }
+                graphics::update_constant_buffer(&config_buffer, &config);
+
+                // Every step uses a new set of VPLs, so accumulation averages out their structured artifacts.
+                if(batch.starts_step && config.vpl_preview) {
+                    graphics::set_compute_shader(&vpl_shader);
+                    graphics::run_compute(VPL_COUNT / VPL_GROUP_SIZE, 1, 1);
+                    graphics::set_compute_shader(&ray_trace_shaders[camera_model]);
+                }
+
+                memcpy(tiles_data->tiles, batch.tiles, batch.tiles_count * sizeof(uint32_t));
+                graphics::update_constant_buffer(&tiles_buffer, tiles_data);
+                graphics::run_compute(batch.tiles_count, 1, 1);
+                tiles_budget -= batch.tiles_count;
+            }
+
+            graphics::unset_texture_compute(0);
+            graphics::unset_texture_compute(1);
+            graphics::unset_texture_compute(2);
+            graphics::unset_texture_compute(3);
+            graphics::unset_texture_compute(4);
+            graphics::unset_texture_compute(5);
+        }
+
+        // Publish finished copy of a frame and start copying the current one. Stream takes frames only when
+        // its client is ready for the next update.
+        if(publish_frames || streaming) {
+            if(streaming) tile_stream::poll(&stream, dt);
+            float *frame_data;
+            int row_pitch;
+            if(frame_readback_pending && readback::map(&frame_readback, (void **)&frame_data, &row_pitch, false)) {
+                if(publish_frames) frame_ring::publish(&frame_ring, frame_data, row_pitch, uint32_t(frame_readback_step));
+                if(streaming) tile_stream::push_frame(&stream, frame_data, row_pitch, uint32_t(frame_readback_step));
+                readback::unmap(&frame_readback);
+                frame_readback_pending = false;
+            }
+            if(!frame_readback_pending && (publish_frames || tile_stream::wants_frame(&stream))) {
+                readback::copy(&frame_readback, &render_texture);
+                frame_readback_pending = true;
+                frame_readback_step = config.step;
+            }
+        }
 
         // Draw texture with ray-traced image.
         graphics::set_render_targets_viewport(&render_target_window);
@@ -347,6 +1199,16 @@ int main(int argc, char **argv) {
             ui_draw::draw_text(text_buffer, Vector2(10, float(window_height) - 10), text_color, Vector2(0, 1));
             sprintf_s(text_buffer, 100, "STEPS %d", config.step);
             ui_draw::draw_text(text_buffer, Vector2(10, float(window_height) - 30), text_color, Vector2(0, 1));
+            sprintf_s(text_buffer, 100, "ALLOCS %u", arena::get_os_allocation_count());
+            ui_draw::draw_text(text_buffer, Vector2(10, float(window_height) - 50), text_color, Vector2(0, 1));
+            sprintf_s(text_buffer, 100, "SAMPLES %d BOUNCES %d", config.num_samples, config.num_bounces);
+            ui_draw::draw_text(text_buffer, Vector2(10, float(window_height) - 70), text_color, Vector2(0, 1));
+            sprintf_s(text_buffer, 100, "FILTER %s", film::get_filter_name(film_filter));
+            ui_draw::draw_text(text_buffer, Vector2(10, float(window_height) - 90), text_color, Vector2(0, 1));
+            sprintf_s(text_buffer, 100, "CAMERA %s", camera::get_model_name(camera_model));
+            ui_draw::draw_text(text_buffer, Vector2(10, float(window_height) - 110), text_color, Vector2(0, 1));
+            sprintf_s(text_buffer, 100, "INTEGRATOR %s", config.vpl_preview ? "INSTANT RADIOSITY" : "PATH TRACING");
+            ui_draw::draw_text(text_buffer, Vector2(10, float(window_height) - 130), text_color, Vector2(0, 1));
 
             // Render controls UI.
             Panel panel = ui::start_panel("", Vector2(10, 10.0f));
@@ -356,10 +1218,66 @@ int main(int argc, char **argv) {
             changed |= ui::add_slider(&panel, "refractive index", &config.refractive_index, 0.5f, 2.0f);
             changed |= ui::add_slider(&panel, "dof radius", &config.dof_radius, 0.0f, .2f);
             changed |= ui::add_slider(&panel, "dof focal plane", &config.dof_focal_plane, 0.0f, 20.0f);
+            changed |= ui::add_slider(&panel, "eye separation", &config.eye_separation, 0.0f, 0.5f);
+            bool cache_changed = ui::add_slider(&panel, "cache cell size", &config.cache_cell_size, 0.05f, 1.0f);
+            // Samples threshold only decides which cells are used, cached radiance stays valid.
+            bool cache_threshold_changed = ui::add_slider(&panel, "cache min samples", &cache_min_samples, 1.0f, 256.0f);
+            changed |= ui::add_slider(&panel, "vpl clamp", &config.vpl_clamp, 0.01f, 4.0f);
+            config.cache_min_samples = int(cache_min_samples + 0.5f);
+            float filter = float(film_filter);
+            changed |= ui::add_slider(&panel, "pixel filter", &filter, 0.0f, float(FILTERS_COUNT - 1));
+
+            // Single sphere editing. Ground sphere can't be edited.
+            ui::add_slider(&panel, "sphere", &selected_sphere, 1.0f, float(SPHERES_COUNT - 1));
+            int sphere_index = int(selected_sphere + 0.5f);
+            Vector4 *sphere_position = &spheres.positions[sphere_index];
+            Vector4 *sphere_material = &spheres.materials[sphere_index];
+            float material = sphere_material->w;
+            bool sphere_moved = ui::add_slider(&panel, "sphere x", &sphere_position->x, -21.0f, 9.0f);
+            sphere_moved |= ui::add_slider(&panel, "sphere z", &sphere_position->z, -15.0f, 15.0f);
+            bool material_changed = ui::add_slider(&panel, "sphere material", &material, 0.0f, float(LIGHT));
+            material_changed &= int(material + 0.5f) != int(sphere_material->w);
+            material_changed |= ui::add_slider(&panel, "sphere roughness", &spheres.parameters[sphere_index].x, 0.0f, 1.0f);
+
+            // Render region's bounds.
+            bool region_changed = false;
+            if(render_region) {
+                region_changed |= ui::add_slider(&panel, "region left", &region.x, 0.0f, 1.0f);
+                region_changed |= ui::add_slider(&panel, "region top", &region.y, 0.0f, 1.0f);
+                region_changed |= ui::add_slider(&panel, "region right", &region.z, 0.0f, 1.0f);
+                region_changed |= ui::add_slider(&panel, "region bottom", &region.w, 0.0f, 1.0f);
+            }
             ui::end_panel(&panel);
 
-            if(changed) {
+            if(region_changed) {
+                apply_region();
+            }
+
+            if(int(filter + 0.5f) != int(film_filter)) {
+                film_filter = FilmFilter(int(filter + 0.5f));
+                film::get_filter_table(film_filter, &filter_table);
+                graphics::update_constant_buffer(&filter_buffer, &filter_table);
+            }
+            if(changed || cache_changed || cache_threshold_changed) {
                 reset_rendering();   
+                is_interacting = true;
+            }
+            if(changed || cache_changed) {
+                invalidate_radiance_cache();
+            }
+            if(int(material + 0.5f) != int(sphere_material->w)) {
+                Material new_material = Material(int(material + 0.5f));
+                *sphere_material = Vector4(get_material_color(new_material), float(new_material));
+            }
+            if(sphere_moved || material_changed) {
+                // Edited sphere's surroundings change the most, so they're traced first.
+                Vector2 film;
+                if(camera::project(Vector3(sphere_position->x, sphere_position->y, sphere_position->z), config.camera_pos, &config.camera, camera_model, &film)) {
+                    order_tiles(film);
+                    tiles_focused = true;
+                }
+                edit_sphere(sphere_index, sphere_moved);
+                invalidate_radiance_cache();
             }
         }
         ui::end_frame();
@@ -367,6 +1285,13 @@ int main(int argc, char **argv) {
         graphics::swap_frames();
     }
 
+    if(publish_frames || streaming) {
+        readback::release(&frame_readback);
+    }
+    if(publish_frames) frame_ring::release(&frame_ring);
+    if(streaming) tile_stream::release(&stream);
+    arena::release(&persistent_arena);
+    arena::release(&frame_arena);
     graphics::release();
 
     return 0;
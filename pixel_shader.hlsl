@@ -10,6 +10,8 @@ SamplerState tex_sampler : register(s0);
 float4 main(PixelInput input) : SV_TARGET
 {
     float4 color = tex.Sample(tex_sampler, input.texcoord_out);
+    // Accumulated colors can be slightly negative next to edges, where filters have negative lobes.
+    color.rgb = saturate(color.rgb);
     color.w = 1.0f;
     return color;
 }
\ No newline at end of file
@@ -2,6 +2,17 @@ static const float PI = 3.141592f;
 static const float PI2 = PI * 2.0f;
 
 RWTexture2D<float4> tex: register(u0);
+// Spheres touched by each pixel's paths since its accumulation started, one bit per sphere.
+RWTexture2D<uint4> dependencies: register(u1);
+// Spheres which primary rays through each pixel can hit, see VisibilityBuffer.
+RWTexture2D<uint> visibility: register(u2);
+static const uint VISIBILITY_ALL = 0xFFFFFFFF;
+// World-space radiance cache, see "Radiance cache" section.
+RWTexture2D<uint> radiance_cache: register(u3);
+// Virtual point lights, one per column. Rows hold position with validity flag in w, normal and intensity.
+RWTexture2D<float4> vpls: register(u4);
+// Rounding error of accumulated colors in tex, carried over to the next step, see accumulate.
+RWTexture2D<float4> accumulation_error: register(u5);
 
 cbuffer ConfigBuffer : register(b0) {
     float3 camera_pos;
@@ -14,28 +25,75 @@ cbuffer ConfigBuffer : register(b0) {
     float refractive_index;
     float dof_radius;
     float dof_focal_plane;
+    int num_samples;
+    int num_bounces;
+    int direct_light_only;
+    int dependency_tracking;
+    uint4 edited_spheres;
+    uint4 moved_spheres;
+    int scenes_per_row;
+    int stereo;
+    float eye_separation;
+    int use_visibility;
+    // Camera's frame, see CameraBasis.
+    float3 camera_right;
+    float film_half_width;
+    float3 camera_up;
+    float film_half_height;
+    float3 camera_forward;
+    float ortho_scale;
+    int radiance_cache_enabled;
+    float cache_cell_size;
+    int cache_min_samples;
+    uint cache_generation;
+    int vpl_preview;
+    // Minimum squared distance between VPL and shaded point, limits VPLs' singularities.
+    float vpl_clamp;
 }
 
+// Camera models, see CameraModel. Shader is compiled with CAMERA_MODEL set to one of these.
+#define CAMERA_PINHOLE 0
+#define CAMERA_THIN_LENS 1
+#define CAMERA_ORTHOGRAPHIC 2
+#define CAMERA_PANORAMA 3
+#ifndef CAMERA_MODEL
+#define CAMERA_MODEL CAMERA_THIN_LENS
+#endif
+static const bool PANORAMA = CAMERA_MODEL == CAMERA_PANORAMA;
+
 static const int SPHERES_COUNT = DEFINE_SPHERES_COUNT;
 
+// Batch rendering traces several scenes at once, each with its own set of spheres.
+#ifdef BATCH_SCENES
+static const int SCENES_COUNT = BATCH_SCENES;
+#else
+static const int SCENES_COUNT = 1;
+#endif
+
 cbuffer geometry_buffer : register(b1) {
-    float4 spheres[SPHERES_COUNT];
-    float4 mats[SPHERES_COUNT];
+    float4 spheres[SPHERES_COUNT * SCENES_COUNT];
+    float4 mats[SPHERES_COUNT * SCENES_COUNT];
+    // Per-sphere material parameters, x is metal roughness.
+    float4 sphere_parameters[SPHERES_COUNT * SCENES_COUNT];
 };
 
-/* Helper functions */
+// Offset of the current scene's spheres.
+static int sphere_offset = 0;
 
-float3x3 get_view_matrix(float3 cam_pos) {
-	float3 y = float3(0,1,0);
-	float3 z = normalize(cam_pos);
-	float3 x = normalize(cross(y, z));
-	y = normalize(cross(z, x));
+static const int MAX_TILES = MAX_TILES_PER_DISPATCH;
 
-	return float3x3(
-		x.x, y.x, z.x,
-		x.y, y.y, z.y,
-		x.z, y.z, z.z);
-}
+// Tiles traced by current dispatch, one thread group per tile.
+// Tile coordinates are packed as x | y << 16.
+cbuffer tiles_buffer : register(b2) {
+    uint4 tiles[MAX_TILES / 4];
+};
+
+// Pixel filter sampling table, see FilterTable. Two entries per vector, each is offset in pixels and sample weight.
+cbuffer filter_buffer : register(b4) {
+    float4 filter_table[FILTER_TABLE_SIZE / 2];
+};
+
+/* Helper functions */
 
 uint wang_hash(uint seed) {
     seed = (seed ^ 61) ^ (seed >> 16);
@@ -50,15 +108,60 @@ float random(int random_seed) {
     return float(wang_hash(random_seed) % 1000000) / 1000000.0f;
 }
 
+/* Fast math */
+
+// Approximations of inverse trigonometric functions. Unlike sin, cos, sqrt and pow, which run on the special
+// function unit, HLSL's asin, acos and atan2 compile into long instruction sequences. Errors are absolute,
+// in radians, maximum over the whole domain. shader_math.cpp mirrors these and checks the bounds.
+
+// Abramowitz & Stegun 4.4.45 mirrored to [-1, 0], error 6.8e-5.
+float fast_acos(float x) {
+    float a = abs(x);
+    float r = sqrt(1.0f - a) * (1.5707288f + a * (-0.2121144f + a * (0.0742610f - 0.0187293f * a)));
+    return x < 0.0f ? PI - r : r;
+}
+
+// Error 6.8e-5, same as fast_acos.
+float fast_asin(float x) {
+    return PI * 0.5f - fast_acos(x);
+}
+
+// Abramowitz & Stegun 4.4.49 on argument reduced to [0, 1] by octant, error 1.3e-5.
+float fast_atan2(float y, float x) {
+    float ax = abs(x);
+    float ay = abs(y);
+    float t = min(ax, ay) / max(max(ax, ay), 1e-30f);
+    float t2 = t * t;
+    float r = t * (0.9998660f + t2 * (-0.3302995f + t2 * (0.1801410f + t2 * (-0.0851330f + t2 * 0.0208351f))));
+    if (ay > ax) r = PI * 0.5f - r;
+    if (x < 0.0f) r = PI - r;
+    return y < 0.0f ? -r : r;
+}
+
+// x^5 with multiplications, exact up to rounding. Pow would go through log2 and exp2.
+float pow5(float x) {
+    float x2 = x * x;
+    return x2 * x2 * x;
+}
+
+float3 pow5(float3 x) {
+    float3 x2 = x * x;
+    return x2 * x2 * x;
+}
+
 float3 uniform_unit_sphere(int random_seed) {
     float azimuth = random(random_seed * 33) * PI2;
-	float polar = acos(2 * random(random_seed * 37 + 3) - 1);
+    // Polar angle's cosine is uniform, sine follows from it without computing the angle.
+    float cos_polar = 2 * random(random_seed * 37 + 3) - 1;
+    float sin_polar = sqrt(saturate(1.0f - cos_polar * cos_polar));
 	float r = pow(random(random_seed * 11 - 7), 1.0f / 3.0f);
+	float sin_azimuth, cos_azimuth;
+	sincos(azimuth, sin_azimuth, cos_azimuth);
 	
 	float3 result = float3(
-        r * cos(azimuth) * sin(polar),
-        r * cos(polar),
-        r * sin(azimuth) * sin(polar)
+        r * cos_azimuth * sin_polar,
+        r * cos_polar,
+        r * sin_azimuth * sin_polar
     );
 	return result;
 }
@@ -98,7 +201,69 @@ float3 refract(float3 rd, float3 n, float ri) {
 float schlick(float c, float ri) {
     float r0 = (1 - ri) / (1 + ri);
     r0 = r0 * r0;
-    return r0 + (1 - r0) * pow((1 - c), 5);
+    return r0 + (1 - r0) * pow5(1 - c);
+}
+
+// Builds orthonormal basis around normal n (Duff et al., "Building an Orthonormal Basis, Revisited").
+void get_basis(float3 n, out float3 t, out float3 b) {
+    float s = n.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (s + n.z);
+    float c = n.x * n.y * a;
+    t = float3(1.0f + s * n.x * n.x * a, s * c, -s * n.x);
+    b = float3(c, s + n.y * n.y * a, -n.y);
+}
+
+// Smith's Lambda function for GGX distribution. Direction w is in tangent space.
+float ggx_lambda(float3 w, float alpha) {
+    float alpha2_tan2 = alpha * alpha * (w.x * w.x + w.y * w.y) / (w.z * w.z);
+    return (sqrt(1.0f + alpha2_tan2) - 1.0f) * 0.5f;
+}
+
+// Samples GGX microfacet normal from the distribution of normals visible from direction v
+// (Heitz, "Sampling the GGX Distribution of Visible Normals"). Vectors are in tangent space.
+float3 sample_ggx_vndf(float3 v, float alpha, float u1, float u2) {
+    // Transform view direction to hemisphere configuration.
+    float3 vh = normalize(float3(alpha * v.x, alpha * v.y, v.z));
+
+    // Orthonormal basis around it.
+    float len2 = vh.x * vh.x + vh.y * vh.y;
+    float3 t1 = len2 > 0.0f ? float3(-vh.y, vh.x, 0.0f) / sqrt(len2) : float3(1.0f, 0.0f, 0.0f);
+    float3 t2 = cross(vh, t1);
+
+    // Sample projected area of visible hemisphere.
+    float r = sqrt(u1);
+    float phi = PI2 * u2;
+    float p1 = r * cos(phi);
+    float p2 = r * sin(phi);
+    float s = 0.5f * (1.0f + vh.z);
+    p2 = (1.0f - s) * sqrt(1.0f - p1 * p1) + s * p2;
+
+    // Reproject onto hemisphere and transform back to ellipsoid configuration.
+    float3 nh = p1 * t1 + p2 * t2 + sqrt(max(0.0f, 1.0f - p1 * p1 - p2 * p2)) * vh;
+    return normalize(float3(alpha * nh.x, alpha * nh.y, max(0.0f, nh.z)));
+}
+
+// Integral of square wave sign(sin(2 * PI * x)).
+float square_wave_integral(float x) {
+    float f = frac(x);
+    return f < 0.5f ? f : 1.0f - f;
+}
+
+// Square wave sign(sin(2 * PI * x)) box filtered over width w.
+float filtered_square_wave(float x, float w) {
+    if (w < 1e-4f) {
+        return sign(sin(x * PI2));
+    }
+    return (square_wave_integral(x + 0.5f * w) - square_wave_integral(x - 0.5f * w)) / w;
+}
+
+// Checkerboard pattern sign(sin(u * 25 * 2PI) * sin(v * 25 * PI)) mapped to [0, 1], box filtered over
+// uv footprint. Pattern is a product of two square waves, so the filtered pattern is product of filtered waves.
+float filtered_checkerboard(float2 uv, float2 footprint) {
+    static const float2 FREQUENCY = float2(25.0f, 12.5f);
+    float x = filtered_square_wave(uv.x * FREQUENCY.x, footprint.x * FREQUENCY.x);
+    float y = filtered_square_wave(uv.y * FREQUENCY.y, footprint.y * FREQUENCY.y);
+    return x * y * 0.5f + 0.5f;
 }
 
 /* Ray tracing logic */
@@ -109,37 +274,84 @@ struct RayHitResult {
     float3 color;
     int material;
     float2 uv;
+    int index;
+    float roughness;
+    float radius;
 };
 
-RayHitResult hit_geometry(float3 rd, float3 rs) {
+// Updates r if sphere i is hit closer than the current hit.
+void hit_sphere(int i, float3 rd, float3 rs, inout RayHitResult r) {
     static const float t_min = 0.001f;
 
+    float4 sphere = spheres[sphere_offset + i];
+    float t = ray_sphere_intersection(rd, rs, sphere.xyz, sphere.w);
+    
+    // We consider it the closest hit if it's in the positive direction of ray
+    // and it's either the first hit (r.t < 0.0) or closer than previously closest hit.
+    if(t > t_min && (t < r.t || r.t < 0)) {
+        // Calculate normal on the sphere's surface.
+        float3 p = rs + rd * t;
+        float3 n = normalize(p - sphere.xyz);
+
+        // Store values into result structure.
+        r.normal = n;
+        r.t = t;
+        r.color = mats[sphere_offset + i].xyz;
+        r.material = round(mats[sphere_offset + i].w);
+        r.index = i;
+        r.roughness = sphere_parameters[sphere_offset + i].x;
+        r.radius = sphere.w;
+        // UV coordinates on a sphere.
+        r.uv.x = 0.5 + fast_atan2(n.x, n.z) / PI2;
+        r.uv.y = 0.5 - fast_asin(n.y) / PI;
+    }
+}
+
+RayHitResult hit_geometry(float3 rd, float3 rs) {
     RayHitResult r;
     r.t = -1; // Initialize current ray hit distance to -1 (no hit)
     for (int i = 0; i < SPHERES_COUNT; ++i) {
-        float4 sphere = spheres[i];
-        float t = ray_sphere_intersection(rd, rs, sphere.xyz, sphere.w);
-        
-        // We consider it the closest hit if it's in the positive direction of ray
-        // and it's either the first hit (r.t < 0.0) or closer than previously closest hit.
-        if(t > t_min && (t < r.t || r.t < 0)) {
-            // Calculate normal on the sphere's surface.
-            float3 p = rs + rd * t;
-            float3 n = normalize(p - sphere.xyz);
-
-            // Store values into result structure.
-            r.normal = n;
-            r.t = t;
-            r.color = mats[i].xyz;
-            r.material = round(mats[i].w);
-            // UV coordinates on a sphere.
-            r.uv.x = 0.5 + atan2(n.x, n.z) / PI2;
-            r.uv.y = 0.5 - asin(n.y) / PI;
-        }
+        hit_sphere(i, rd, rs, r);
+    }
+    return r;
+}
+
+// Spheres which can be hit by primary rays of the current tile, built by build_tile_spheres.
+groupshared uint tile_spheres[SPHERES_COUNT];
+groupshared uint tile_spheres_count;
+static bool tile_culling = false;
+
+// Closest hit of a primary ray of the current tile. Tests only the tile's spheres if they're available.
+RayHitResult hit_tile_spheres(float3 rd, float3 rs) {
+    if (!tile_culling) {
+        return hit_geometry(rd, rs);
+    }
+    RayHitResult r;
+    r.t = -1;
+    for (uint i = 0; i < tile_spheres_count; ++i) {
+        hit_sphere(int(tile_spheres[i]), rd, rs, r);
     }
     return r;
 }
 
+// Closest hit of a primary ray traced within pixel's filter footprint. Pinhole camera's primary rays
+// test only spheres from the pixel's visibility buffer entry, unless there are too many of them.
+RayHitResult hit_primary(float3 rd, float3 rs, uint2 pixel) {
+#if CAMERA_MODEL == CAMERA_PINHOLE
+    if (use_visibility) {
+        uint candidates = visibility[pixel];
+        if (candidates != VISIBILITY_ALL) {
+            RayHitResult r;
+            r.t = -1;
+            if (candidates & 0xFFFF) hit_sphere(int(candidates & 0xFFFF) - 1, rd, rs, r);
+            if (candidates >> 16) hit_sphere(int(candidates >> 16) - 1, rd, rs, r);
+            return r;
+        }
+    }
+#endif
+    return hit_tile_spheres(rd, rs);
+}
+
 // Materials definitions
 #define LAMBERT 0
 #define LAMBERT_CHECKERBOARD 1
@@ -147,54 +359,262 @@ RayHitResult hit_geometry(float3 rd, float3 rs) {
 #define DIELECTRIC 3
 #define LIGHT 4
 
-float3 get_ray_color(float3 rd, float3 rs, int depth, int random_seed) {
-    static const int NUM_BOUNCES = 10;
+// Parameters which don't influence primary rays, so they can differ between variants sharing them.
+struct ShadingParams {
+    float ambient_light_intensity;
+    float sphere_lights_intensity;
+    float metal_roughness;
+    float refractive_index;
+};
+
+ShadingParams get_shading_params() {
+    ShadingParams params;
+    params.ambient_light_intensity = ambient_light_intensity;
+    params.sphere_lights_intensity = sphere_lights_intensity;
+    params.metal_roughness = metal_roughness;
+    params.refractive_index = refractive_index;
+    return params;
+}
+
+// Ray cone tracks footprint of the pixel along the path (Akenine-Moller et al., "Texture Level of Detail
+// Strategies for Real-Time Ray Tracing"). Camera rays start with zero width and spread of one pixel.
+// After a diffuse bounce, the footprint is only approximate, so we just use a fixed wide spread.
+static const float DIFFUSE_CONE_SPREAD = 0.2f;
+
+// Albedo of lambertian hit. Checkerboard pattern is filtered over the footprint converted to uv space.
+float3 get_lambert_albedo(RayHitResult result, float footprint) {
+    float s = 1.0f;
+    if (result.material == LAMBERT_CHECKERBOARD) {
+        // U goes around the sphere's y axis, v from pole to pole.
+        float axis_distance = max(length(result.normal.xz), 1e-3f);
+        float2 footprint_uv = float2(
+            footprint / (PI2 * result.radius * axis_distance),
+            footprint / (PI * result.radius)
+        );
+        s = filtered_checkerboard(result.uv, footprint_uv);
+    }
+    return result.color * s;
+}
+
+// Samples direction of a ray leaving lambertian surface at point p with normal n.
+float3 sample_lambert(float3 p, float3 n, int random_seed) {
+    // Sampling points in a sphere above surface in direction of surface normal
+    // should follow cosine distribution - lambertian surface.
+    float3 r = uniform_unit_sphere(random_seed) + p + n;
+    return normalize(r - p);
+}
+
+/* Radiance cache */
+
+// Hash grid caching radiance leaving diffuse surfaces, keyed on quantized position and normal.
+// Every cell has 5 texels, one in each block of CACHE_ROWS rows: key, red, green and blue sum and samples count.
+// Radiance is stored in fixed point, so cells can be updated concurrently with integer atomics and no locks.
+// Keys are stamped with cache generation, which changes whenever the scene changes, so stale cells are reused.
+// Key keeps only generation's lowest 8 bits, the whole cache is cleared whenever these wrap around.
+static const uint CACHE_WIDTH = RADIANCE_CACHE_WIDTH;
+static const uint CACHE_ROWS = RADIANCE_CACHE_ROWS;
+static const uint CACHE_CELLS = CACHE_WIDTH * CACHE_ROWS;
+static const uint CACHE_PROBES = 4;
+static const float CACHE_RADIANCE_SCALE = 256.0f;
+// Sample's radiance is clamped, so the sums don't overflow before reaching the maximum samples count.
+static const float CACHE_MAX_RADIANCE = 256.0f;
+static const uint CACHE_MAX_SAMPLES = 4096;
+// Fraction of paths which are traced in full and update the cache instead of reading it.
+static const float CACHE_TRAINING_FRACTION = 0.25f;
+// Number of diffuse vertices per path that update the cache.
+static const int CACHE_MAX_VERTICES = 2;
+
+uint2 get_cache_texel(uint cell, uint channel) {
+    return uint2(cell % CACHE_WIDTH, cell / CACHE_WIDTH + channel * CACHE_ROWS);
+}
+
+// Returns first cell to probe for point p with normal n. Key identifies the cell, it's never zero, which marks empty cells.
+uint get_cache_cell(float3 p, float3 n, out uint key) {
+    int3 position = int3(floor(p / cache_cell_size));
+    // Three values per normal's axis.
+    int3 normal = int3(round(n)) + 1;
+    uint hash = wang_hash(uint(position.x) ^ wang_hash(uint(position.y) ^ wang_hash(uint(position.z) ^ wang_hash(uint(normal.x + normal.y * 3 + normal.z * 9)))));
+    key = (wang_hash(hash ^ 0x9e3779b9) & 0xFFFFFF00) | (cache_generation & 0xFF);
+    return hash % CACHE_CELLS;
+}
+
+// Returns cached radiance leaving point p with normal n, if the cell has enough samples.
+bool lookup_radiance_cache(float3 p, float3 n, out float3 radiance) {
+    radiance = float3(0,0,0);
+    uint key;
+    uint cell = get_cache_cell(p, n, key);
+    for (uint i = 0; i < CACHE_PROBES; ++i) {
+        uint probe = (cell + i) % CACHE_CELLS;
+        if (radiance_cache[get_cache_texel(probe, 0)] == key) {
+            uint count = radiance_cache[get_cache_texel(probe, 4)];
+            if (count < uint(cache_min_samples)) {
+                return false;
+            }
+            uint3 sum = uint3(radiance_cache[get_cache_texel(probe, 1)], radiance_cache[get_cache_texel(probe, 2)], radiance_cache[get_cache_texel(probe, 3)]);
+            radiance = float3(sum) / (CACHE_RADIANCE_SCALE * float(count));
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns index of cell for given key, claiming an empty or stale cell if the key isn't in the cache yet.
+// Returns CACHE_CELLS if all probed cells are taken.
+uint claim_cache_cell(uint cell, uint key) {
+    for (uint i = 0; i < CACHE_PROBES; ++i) {
+        uint probe = (cell + i) % CACHE_CELLS;
+        uint original;
+        InterlockedCompareExchange(radiance_cache[get_cache_texel(probe, 0)], 0, key, original);
+        if (original == 0 || original == key) {
+            return probe;
+        }
+
+        // Cell from older generation. Whoever replaces its key resets the sums, samples added by others
+        // in the meantime may be lost, which only slows down the cell's convergence.
+        if ((original & 0xFF) != (key & 0xFF)) {
+            uint replaced;
+            InterlockedCompareExchange(radiance_cache[get_cache_texel(probe, 0)], original, key, replaced);
+            if (replaced == original) {
+                for (uint channel = 1; channel < 5; ++channel) {
+                    InterlockedExchange(radiance_cache[get_cache_texel(probe, channel)], 0, replaced);
+                }
+                return probe;
+            }
+            if (replaced == key) {
+                return probe;
+            }
+        }
+    }
+    return CACHE_CELLS;
+}
+
+// Adds sample of radiance leaving point with given cell and key.
+void update_radiance_cache(uint cell, uint key, float3 radiance) {
+    cell = claim_cache_cell(cell, key);
+    if (cell == CACHE_CELLS || radiance_cache[get_cache_texel(cell, 4)] >= CACHE_MAX_SAMPLES) {
+        return;
+    }
+    uint3 value = uint3(min(radiance, CACHE_MAX_RADIANCE) * CACHE_RADIANCE_SCALE);
+    InterlockedAdd(radiance_cache[get_cache_texel(cell, 1)], value.r);
+    InterlockedAdd(radiance_cache[get_cache_texel(cell, 2)], value.g);
+    InterlockedAdd(radiance_cache[get_cache_texel(cell, 3)], value.b);
+    InterlockedAdd(radiance_cache[get_cache_texel(cell, 4)], 1);
+}
+
+/* Path tracing */
+
+// Traces path with given number of bounces starting with ray rd, rs, whose closest hit is already known.
+// Cone is the ray cone's width and spread at the ray's start.
+// With radiance cache, paths end at the first diffuse vertex after the camera's hit which is in the cache.
+// Training paths are traced in full instead, radiance leaving their diffuse vertices is their final color
+// divided by the throughput with which the path arrived at the vertex.
+float3 trace_path(float3 rd, float3 rs, RayHitResult first_hit, int random_seed, ShadingParams params,
+                  int bounces, float2 cone, inout uint4 touched) {
+    float cone_width = cone.x;
+    float cone_spread = cone.y;
+
+    // Depth of the first vertex, continued paths don't start at the camera.
+    int first_depth = num_bounces - bounces;
+    bool training = random(random_seed * 41 + 13) < CACHE_TRAINING_FRACTION;
+    bool cache_lookup = radiance_cache_enabled && !training;
+    bool cache_update = radiance_cache_enabled && training && !direct_light_only;
+    uint cache_cells[CACHE_MAX_VERTICES];
+    uint cache_keys[CACHE_MAX_VERTICES];
+    float3 cache_throughputs[CACHE_MAX_VERTICES];
+    int cache_vertices = 0;
 
     float3 color = float3(1,1,1);
-    for(int i = 0; i < NUM_BOUNCES; ++i) {
-        RayHitResult result = hit_geometry(rd, rs);
+    float3 radiance = float3(0,0,0);
+    bool finished = false;
+    for(int i = 0; i < bounces; ++i) {
+        RayHitResult result = first_hit;
+        if (i > 0) {
+            result = hit_geometry(rd, rs);
+        }
 
         // No hit - ambient lighting.
         if(result.t <= 0.0f) {
-            color *= float3(1.0f, 1.0f, 1.0f) * ambient_light_intensity;
-            return color;
+            radiance = color * params.ambient_light_intensity;
+            finished = true;
+            break;
+        }
+
+        // Remember which sphere the path touched.
+        if (dependency_tracking) {
+            touched[result.index / 32] |= 1u << (result.index % 32);
         }
 
         // Get ray hit's position and normal vector at that point.
         float3 n = result.normal;
         float3 p = result.t * rd + rs;
 
+        // Cone's footprint on the surface, stretched at grazing angles.
+        cone_width += cone_spread * result.t;
+        float footprint = cone_width / max(abs(dot(rd, n)), 0.05f);
+
         // Calculate color update and next ray based on material hit.
         if (result.material == LAMBERT || result.material == LAMBERT_CHECKERBOARD) {
-            // Sample next ray direction.
-            // Sampling points in a sphere above surface in direction of surface normal
-            // should follow cosine distribution - lambertian surface.
-            float3 r = uniform_unit_sphere(random_seed * 31 * (i + 1)) + p + n;
-            
+            if (first_depth + i > 0) {
+                float3 cached;
+                if (cache_lookup && lookup_radiance_cache(p, n, cached)) {
+                    radiance = color * cached;
+                    finished = true;
+                    break;
+                }
+                if (cache_update && cache_vertices < CACHE_MAX_VERTICES) {
+                    cache_cells[cache_vertices] = get_cache_cell(p, n, cache_keys[cache_vertices]);
+                    cache_throughputs[cache_vertices] = color;
+                    cache_vertices++;
+                }
+            }
+
             // Update next ray's position and direction.
-            rd = normalize(r - p);
+            rd = sample_lambert(p, n, random_seed * 31 * (i + 1));
             rs = p;
 
             // Update color.
-            float s = 1.0f;
-            if (result.material == LAMBERT_CHECKERBOARD) {
-                // Checkerboard pattern.
-                s = sin(result.uv.x * PI2 * 25.0f) * sin(result.uv.y * PI * 25.0f);
-                s = sign(s) * 0.5f + 0.5f;
-            }
-            color *= result.color * s;
+            color *= get_lambert_albedo(result, footprint);
+            cone_spread = max(cone_spread, DIFFUSE_CONE_SPREAD);
         } else if(result.material == METAL) {
-            // Reflect incident ray and add some noise to make the metallic surface more diffuse.
-            float3 r = reflect(rd, n) + uniform_unit_sphere(random_seed * 19 * (i + 1)) * metal_roughness;
+            // GGX microfacet reflection. Sphere's roughness is scaled by the global metal roughness.
+            float roughness = result.roughness * params.metal_roughness;
+            float alpha = roughness * roughness;
+
+            // Work in tangent space, normal is z axis.
+            float3 t, b;
+            get_basis(n, t, b);
+            float3 v = float3(dot(-rd, t), dot(-rd, b), max(dot(-rd, n), 1e-4f));
+
+            // Microfacet normal is sampled from the normals visible from the incoming direction,
+            // so almost all reflected rays stay above the surface. Very smooth surfaces are just mirrors.
+            float3 h = float3(0.0f, 0.0f, 1.0f);
+            if (alpha > 1e-4f) {
+                h = sample_ggx_vndf(v, alpha, random(random_seed * 19 * (i + 1)), random(random_seed * 23 * (i + 1) + 7));
+            }
+            float3 l = reflect(-v, h);
+
+            // Reflected ray below the surface is masked by the microsurface, so the path ends here.
+            if (l.z <= 0.0f) {
+                finished = true;
+                break;
+            }
 
             // Update next ray's position and direction.
-            rd = normalize(r);
+            rd = l.x * t + l.y * b + l.z * n;
             rs = p;
 
-            // Update color.
-            color *= result.color;
+            // Convex mirror with radius R has focal length R / 2, so it widens the cone's spread by 2 * width / R.
+            // Microfacets blur the reflection further, roughly by the width of the lobe.
+            cone_spread += 2.0f * cone_width / result.radius + alpha;
+
+            // Update color. With visible normals sampling, sample's weight is F * G2 / G1.
+            // Metal's color is its reflectance at normal incidence.
+            float3 fresnel = result.color + (1.0f - result.color) * pow5(1.0f - saturate(dot(v, h)));
+            float lambda_v = ggx_lambda(v, alpha);
+            float lambda_l = ggx_lambda(l, alpha);
+            color *= fresnel * (1.0f + lambda_v) / (1.0f + lambda_v + lambda_l);
         } else if(result.material == DIELECTRIC) {
-            float ri = 1.0f / refractive_index;
+            float ri = 1.0f / params.refractive_index;
 
             // Normal pointing in the same direction as ray means we hit a sphere from the inside.
             // That means we have to reflect the normal and invert the refractive index.
@@ -227,58 +647,558 @@ float3 get_ray_color(float3 rd, float3 rs, int depth, int random_seed) {
             color *= result.color;
         } else if(result.material == LIGHT) {
             // In case we hit a light source, we're ending ray tracing and just updating the accumulated color.
-            color *= result.color * sphere_lights_intensity;
+            radiance = color * result.color * params.sphere_lights_intensity;
+            finished = true;
             break;
         }
     }
 
-    return color;
+    // Ran out of bounces without reaching any light. With direct lighting only,
+    // such paths don't contribute, so the preview isn't brightened by unfinished paths.
+    if (!finished && !direct_light_only) {
+        radiance = color;
+    }
+
+    // Vertices reached with tiny throughput would amplify the noise, they're skipped.
+    for (int v = 0; v < cache_vertices; ++v) {
+        float3 throughput = cache_throughputs[v];
+        if (min(throughput.r, min(throughput.g, throughput.b)) > 1e-3f) {
+            update_radiance_cache(cache_cells[v], cache_keys[v], radiance / throughput);
+        }
+    }
+    return radiance;
 };
 
-[numthreads(GROUP_SIZE_X,GROUP_SIZE_Y,1)]
-void main(uint3 threadIDInGroup : SV_GroupThreadID, uint3 groupID : SV_GroupID,
-          uint3 dispatchThreadId : SV_DispatchThreadID){
-    uint2 p = dispatchThreadId.xy;
+// Ray cone of a camera ray, its width at the camera and spread angle, which is the angle covered by a single pixel.
+// Panorama's pixels are the widest at the equator. Orthographic rays don't spread, they're a pixel wide from the start.
+float2 get_pixel_cone() {
+    float pixel_size = 2.0f * film_half_width / float(screen_width);
+#if CAMERA_MODEL == CAMERA_PANORAMA
+    return float2(0.0f, PI2 / float(screen_width));
+#elif CAMERA_MODEL == CAMERA_ORTHOGRAPHIC
+    return float2(pixel_size * ortho_scale, 0.0f);
+#else
+    return float2(0.0f, pixel_size);
+#endif
+}
 
-    static const int NUM_SAMPLES = 32;
-    float3 final_color = float3(0,0,0);
-    for (int i = 0; i < NUM_SAMPLES; ++i) {
-        // Used for random number generator.
-        int random_seed = p.x * 317 * p.y * 911 * (step * NUM_SAMPLES + i);
+// Traces path starting with camera ray rd, rs, whose closest hit is already known.
+float3 get_ray_color(float3 rd, float3 rs, RayHitResult first_hit, int random_seed, ShadingParams params, inout uint4 touched) {
+    float2 cone = get_pixel_cone();
+    return trace_path(rd, rs, first_hit, random_seed, params, num_bounces, cone, touched);
+}
 
-        // Compute x and y ray directions in "neutral" camera position.
-        float aspect_ratio = float(screen_width) / float(screen_height);
-        float rx = float(p.x + random(random_seed * 11)) / float(screen_width) * 2.0f - 1.0f;
-        float ry = float(p.y + random(random_seed * 17)) / float(screen_height) * 2.0f - 1.0f;
-        ry /= aspect_ratio;
-        
-        // Compute depth of field ray origin offset.
-        float r = random(random_seed * 19) * PI2;
-        float3 dof_offset = float3(sin(r), cos(r), 0) * dof_radius;
+float2 get_filter_entry(int i) {
+    float4 entries = filter_table[i / 2];
+    return i % 2 == 0 ? entries.xy : entries.zw;
+}
 
-        // Ray's target position on a focal plane.
-        // Note that we have to first rotate according to camera position and then
-        // make that position relative to camera position.
-        float3 rt = float3(rx, ry, -1.0f) * dof_focal_plane;
-        rt = mul(get_view_matrix(camera_pos), rt);
-        rt += camera_pos;
+// Samples offset from pixel's center along one axis of the pixel filter. Weight is multiplied by the sample's weight.
+float sample_filter(float u, inout float weight) {
+    // Lower half of the random range samples negative offsets.
+    float side = u < 0.5f ? -1.0f : 1.0f;
+    float position = frac(u * 2.0f) * (FILTER_TABLE_SIZE - 1);
+    int i = min(int(position), FILTER_TABLE_SIZE - 2);
+    float2 a = get_filter_entry(i);
+    float2 b = get_filter_entry(i + 1);
+    weight *= a.y;
+    return side * lerp(a.x, b.x, position - float(i));
+}
 
-        // Ray start and direction.
-        float3 rs = camera_pos + dof_offset;
-        float3 rd = normalize(rt - rs);
+// Samples position on the film, distributed around pixel's center by the pixel filter.
+// Weighted sum of samples divided by samples count is then the filtered pixel value.
+float2 sample_film(uint2 pixel, int random_seed, out float weight) {
+    weight = 1.0f;
+    float dx = sample_filter(random(random_seed * 11), weight);
+    float dy = sample_filter(random(random_seed * 17), weight);
+    return float2(pixel) + 0.5f + float2(dx, dy);
+}
 
-        // Get current ray's color.
-        float3 ray_color = get_ray_color(rd, rs, 4, random_seed);
-        final_color += ray_color;
+// Returns latitude of film position in equirectangular panorama, from -PI/2 to PI/2.
+float get_panorama_latitude(float film_y) {
+    return (film_y / float(screen_height) - 0.5f) * PI;
+}
+
+// Generates camera ray through given position on the film, in pixels.
+// Lens is used only by the thin lens camera, the other models have all rays start at the camera's plane.
+void get_camera_ray(float2 film_position, int random_seed, float lens_radius, float focal_plane, out float3 rs, out float3 rd) {
+#if CAMERA_MODEL == CAMERA_PANORAMA
+    // Equirectangular panorama centered at camera position, longitude 0 looks in the camera's direction.
+    float longitude = (film_position.x / float(screen_width) - 0.5f) * PI2;
+    float latitude = get_panorama_latitude(film_position.y);
+    rd = cos(latitude) * sin(longitude) * camera_right + sin(latitude) * camera_up + cos(latitude) * cos(longitude) * camera_forward;
+    rs = camera_pos;
+#else
+    // Position on the film at unit distance from the camera.
+    float2 film = (film_position / float2(screen_width, screen_height) * 2.0f - 1.0f) * float2(film_half_width, film_half_height);
+    float3 film_offset = film.x * camera_right + film.y * camera_up;
+#if CAMERA_MODEL == CAMERA_ORTHOGRAPHIC
+    rs = camera_pos + film_offset * ortho_scale;
+    rd = camera_forward;
+#else
+    rs = camera_pos;
+    rd = normalize(film_offset + camera_forward);
+#if CAMERA_MODEL == CAMERA_THIN_LENS
+    // Uniformly sampled point on the lens disk. Ray goes through it towards the film position's point on the focal plane.
+    float3 focus = camera_pos + (film_offset + camera_forward) * focal_plane;
+    float lens_r = sqrt(random(random_seed * 19)) * lens_radius;
+    float lens_angle = random(random_seed * 29) * PI2;
+    rs = camera_pos + (cos(lens_angle) * camera_right + sin(lens_angle) * camera_up) * lens_r;
+    rd = normalize(focus - rs);
+#endif
+#endif
+#endif
+}
+
+// Builds list of spheres which primary rays of the tile with given first pixel can hit, every thread tests one sphere.
+// Rays go through the tile's pixels expanded by the filter's footprint, so their directions lie within a cone
+// around the tile's center. Thin lens and stereo move ray origins up to some distance from the camera,
+// which is the same as growing spheres by that distance, and lens also bends rays towards the focal plane.
+// Has to be called by all threads of the group, before any of them exits.
+void build_tile_spheres(uint group_index, uint2 tile_origin) {
+#if CAMERA_MODEL == CAMERA_PINHOLE || CAMERA_MODEL == CAMERA_THIN_LENS
+    if (group_index == 0) {
+        tile_spheres_count = 0;
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    // Cone containing directions through the tile's corners. Filter table's last entry is the filter's radius.
+    float footprint = get_filter_entry(FILTER_TABLE_SIZE - 1).x;
+    float2 tile_min = float2(tile_origin) - footprint;
+    float2 tile_max = float2(tile_origin + uint2(GROUP_SIZE_X, GROUP_SIZE_Y)) + footprint;
+    float2 film_scale = float2(film_half_width, film_half_height) * 2.0f / float2(screen_width, screen_height);
+    float2 film_min = tile_min * film_scale - float2(film_half_width, film_half_height);
+    float2 film_max = tile_max * film_scale - float2(film_half_width, film_half_height);
+    float2 film_center = (film_min + film_max) * 0.5f;
+    float3 axis = normalize(film_center.x * camera_right + film_center.y * camera_up + camera_forward);
+    float cos_tile = 1.0f;
+    for (int corner = 0; corner < 4; ++corner) {
+        float2 film = float2(corner & 1 ? film_max.x : film_min.x, corner & 2 ? film_max.y : film_min.y);
+        cos_tile = min(cos_tile, dot(axis, normalize(film.x * camera_right + film.y * camera_up + camera_forward)));
+    }
+    float angle = acos(cos_tile);
+
+    float origin_offset = stereo ? 0.5f * eye_separation : 0.0f;
+#if CAMERA_MODEL == CAMERA_THIN_LENS
+    origin_offset += dof_radius;
+    angle += dof_focal_plane > dof_radius ? asin(dof_radius / dof_focal_plane) : PI;
+#endif
+
+    for (uint i = group_index; i < uint(SPHERES_COUNT); i += GROUP_SIZE_X * GROUP_SIZE_Y) {
+        float4 sphere = spheres[sphere_offset + i];
+        float3 v = sphere.xyz - camera_pos;
+        float distance = length(v);
+        float radius = sphere.w + origin_offset;
+        bool visible = distance <= radius || dot(axis, v / distance) >= cos(min(angle + asin(radius / distance), PI));
+        if (visible) {
+            uint slot;
+            InterlockedAdd(tile_spheres_count, 1, slot);
+            tile_spheres[slot] = i;
+        }
+    }
+    GroupMemoryBarrierWithGroupSync();
+    tile_culling = true;
+#endif
+}
+
+// Reinhard tone mapping
+float3 tone_map(float3 color) {
+    // Negative filter lobes can make a step's color negative. Curve is symmetric around zero,
+    // so these steps don't blow up near l = -1 and still cancel out with positive ones in the average.
+    float l = dot(float3(0.2126, 0.7152, 0.0722), color);
+    return color / (abs(l) + 1);
+}
+
+// Adds new step's color to pixel's running average. Alpha holds the number of steps accumulated in the pixel.
+// Step's increment (color - average) / n shrinks with n, while the rounding error of adding it to the average
+// stays at half an ulp of the average. With plain addition, an average around 0.5 stops moving once the increment
+// is below 2^-25, for a pixel whose steps differ from the average by 5% that's after ~1.7M steps, and the bias
+// of rounding grows long before. Kahan summation keeps the rounded off part in compensation and adds it
+// back in the next step, so the average's error stays within a few ulps for any number of steps.
+// Counter in alpha is exact up to 2^24 steps. shader_math.cpp mirrors this and checks the bound.
+float4 accumulate(float4 previous, float3 color, inout float3 compensation) {
+    float n = previous.w + 1.0f;
+    precise float3 increment = (color - previous.rgb) / n - compensation;
+    precise float3 average = previous.rgb + increment;
+    precise float3 error = (average - previous.rgb) - increment;
+    compensation = error;
+    return float4(average, n);
+}
+
+// Compacts even bits of x into its lower half.
+uint compact_bits(uint x) {
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0F0F0F0F;
+    x = (x | (x >> 4)) & 0x00FF00FF;
+    x = (x | (x >> 8)) & 0x0000FFFF;
+    return x;
+}
+
+// Returns pixel traced by the thread. Every group traces one tile from the tile list.
+// Threads walk the tile in Morton order, so every 32 thread wave covers an 8x4 block instead of a 32 pixel row.
+// Its primary rays are then more coherent and its texture reads and writes touch fewer cache lines.
+uint2 get_tile_pixel(uint group_index, uint3 groupID) {
+    uint tile = tiles[groupID.x / 4][groupID.x % 4];
+    uint2 tile_pixel = uint2(compact_bits(group_index), compact_bits(group_index >> 1));
+    return uint2(tile & 0xFFFF, tile >> 16) * uint2(GROUP_SIZE_X, GROUP_SIZE_Y) + tile_pixel;
+}
+
+/* Instant radiosity */
+
+// Number of VPLs every sample gathers. Samples take interleaved subsets, so all VPLs contribute over a few samples.
+static const int VPL_GATHER_COUNT = 32;
+
+// Instant radiosity preview. Diffuse camera hits gather light from a subset of VPLs and direct ambient light
+// sampled with a single cosine distributed ray. Other hits are path traced. VPLs' contribution is clamped,
+// so the result is biased, path tracer remains the reference.
+float3 get_vpl_color(float3 rd, float3 rs, RayHitResult hit, int random_seed, ShadingParams params, inout uint4 touched) {
+    bool is_lambert = hit.t > 0.0f && (hit.material == LAMBERT || hit.material == LAMBERT_CHECKERBOARD);
+    if (!is_lambert) {
+        return get_ray_color(rd, rs, hit, random_seed, params, touched);
+    }
+
+    float3 p = rs + rd * hit.t;
+    float3 n = hit.normal;
+    float2 cone = get_pixel_cone();
+    float3 albedo = get_lambert_albedo(hit, (cone.x + cone.y * hit.t) / max(abs(dot(rd, n)), 0.05f));
+
+    // Ambient light. With cosine distributed ray, the estimate is just the ambient intensity if the ray escapes.
+    float3 ambient_rd = sample_lambert(p, n, random_seed * 31);
+    float3 light = hit_geometry(ambient_rd, p).t <= 0.0f ? params.ambient_light_intensity : 0.0f;
+
+    // VPLs, every one of them has to be visible from the shaded point.
+    float3 gathered = float3(0,0,0);
+    uint offset = uint(random(random_seed * 43) * VPL_COUNT);
+    for (int k = 0; k < VPL_GATHER_COUNT; ++k) {
+        uint index = (offset + uint(k) * (VPL_COUNT / VPL_GATHER_COUNT)) % VPL_COUNT;
+        float4 position = vpls[uint2(index, 0)];
+        if (position.w == 0.0f) {
+            continue;
+        }
+        float3 to_vpl = position.xyz - p;
+        float distance2 = dot(to_vpl, to_vpl);
+        float distance = sqrt(distance2);
+        float3 l = to_vpl / distance;
+        float cos_x = dot(n, l);
+        float cos_y = -dot(vpls[uint2(index, 1)].xyz, l);
+        if (cos_x <= 0.0f || cos_y <= 0.0f) {
+            continue;
+        }
+        RayHitResult occluder = hit_geometry(l, p);
+        if (occluder.t > 0.0f && occluder.t < distance * 0.999f) {
+            continue;
+        }
+        gathered += vpls[uint2(index, 2)].rgb * cos_x * cos_y / max(distance2, vpl_clamp);
+    }
+    light += gathered * (float(VPL_COUNT) / float(VPL_GATHER_COUNT)) / PI;
+    return albedo * light;
+}
+
+#if defined(VPL_GENERATION)
+
+// Approximate bounds of the random spheres, see generate_spheres. Ambient light's particles start on a disk covering them.
+static const float3 VPL_SCENE_CENTER = float3(-6.0f, 0.0f, 0.0f);
+static const float VPL_SCENE_RADIUS = 17.0f;
+
+void store_vpl(uint index, float3 position, float3 normal, float3 intensity, bool valid) {
+    vpls[uint2(index, 0)] = float4(position, valid ? 1.0f : 0.0f);
+    vpls[uint2(index, 1)] = float4(normal, 0.0f);
+    vpls[uint2(index, 2)] = float4(intensity, 0.0f);
+}
+
+// Generates VPLs. Every thread traces one particle. With sphere lights, a quarter of particles are VPLs
+// on the lights' surfaces, another quarter leaves the lights and becomes VPL where it hits a diffuse sphere.
+// The rest comes from the ambient light, from the upper hemisphere. VPL's intensity is particle's power
+// times albedo over PI, so shading is albedo / PI * intensity * geometry term.
+[numthreads(VPL_GROUP_SIZE,1,1)]
+void main(uint3 dispatchThreadId : SV_DispatchThreadID) {
+    uint i = dispatchThreadId.x;
+    int random_seed = int((i + 1) * 7919 + uint(step) * 104729);
+
+    int lights_count = 0;
+    for (int s = 0; s < SPHERES_COUNT; ++s) {
+        if (round(mats[s].w) == LIGHT) lights_count++;
+    }
+    bool from_light = lights_count > 0 && i % 4 < 2;
+    float source_fraction = lights_count > 0 ? (from_light ? 0.25f : 0.5f) : 1.0f;
+    float particles = float(VPL_COUNT) * source_fraction;
+
+    float3 origin, direction, power;
+    if (from_light) {
+        // Uniformly picked light and point on its surface.
+        int target = min(int(random(random_seed * 3) * lights_count), lights_count - 1);
+        int light = 0;
+        for (int s = 0; s < SPHERES_COUNT; ++s) {
+            if (round(mats[s].w) != LIGHT) continue;
+            if (target == 0) {
+                light = s;
+                break;
+            }
+            target--;
+        }
+        float4 sphere = spheres[light];
+        float3 normal = normalize(uniform_unit_sphere(random_seed * 5));
+        origin = sphere.xyz + normal * sphere.w;
+        float area = 4.0f * PI * sphere.w * sphere.w;
+        float3 emission = mats[light].xyz * sphere_lights_intensity;
+        if (i % 4 == 0) {
+            store_vpl(i, origin, normal, emission * area * lights_count / particles, true);
+            return;
+        }
+        direction = sample_lambert(origin, normal, random_seed * 7);
+        power = emission * area * lights_count * PI / particles;
+    } else {
+        // Direction from the upper hemisphere and point on a disk perpendicular to it.
+        float3 w = normalize(uniform_unit_sphere(random_seed * 5));
+        w.y = abs(w.y);
+        float3 t, b;
+        get_basis(w, t, b);
+        float disk_r = sqrt(random(random_seed * 17)) * VPL_SCENE_RADIUS;
+        float disk_angle = random(random_seed * 19) * PI2;
+        origin = VPL_SCENE_CENTER + w * 2.0f * VPL_SCENE_RADIUS + (t * cos(disk_angle) + b * sin(disk_angle)) * disk_r;
+        direction = -w;
+        power = ambient_light_intensity * PI2 * PI * VPL_SCENE_RADIUS * VPL_SCENE_RADIUS / particles;
+    }
+
+    RayHitResult hit = hit_geometry(direction, origin);
+    bool is_lambert = hit.t > 0.0f && (hit.material == LAMBERT || hit.material == LAMBERT_CHECKERBOARD);
+    if (!is_lambert) {
+        store_vpl(i, float3(0,0,0), float3(0,0,0), float3(0,0,0), false);
+        return;
+    }
+    float3 albedo = get_lambert_albedo(hit, 0.0f);
+    store_vpl(i, origin + direction * hit.t, hit.normal, power * albedo / PI, true);
+}
+
+#elif defined(SWEEP_MAX_VARIANTS)
+
+// Parameter sweep renders several variants of the same view next to each other.
+cbuffer sweep_buffer : register(b3) {
+    // Ambient light intensity, sphere lights intensity, metal roughness, refractive index.
+    float4 variant_shading[SWEEP_MAX_VARIANTS];
+    // Depth of field radius and focal plane.
+    float4 variant_lens[SWEEP_MAX_VARIANTS];
+    int variants_count;
+    int variants_per_row;
+    int share_primary_rays;
+}
+
+[numthreads(GROUP_SIZE_X * GROUP_SIZE_Y,1,1)]
+void main(uint groupIndex : SV_GroupIndex, uint3 groupID : SV_GroupID){
+    uint2 pixel = get_tile_pixel(groupIndex, groupID);
+    if (pixel.x >= uint(screen_width) || pixel.y >= uint(screen_height)) {
+        return;
+    }
+
+    float3 final_colors[SWEEP_MAX_VARIANTS];
+    for (int v = 0; v < variants_count; ++v) {
+        final_colors[v] = float3(0,0,0);
+    }
+
+    uint4 touched = uint4(0,0,0,0);
+    for (int i = 0; i < num_samples; ++i) {
+        // All variants use the same random numbers, so the differences between them aren't hidden by noise.
+        int random_seed = pixel.x * 317 * pixel.y * 911 * (step * num_samples + i);
+
+        float weight;
+        float2 film_position = sample_film(pixel, random_seed, weight);
+
+        // If only shading parameters are swept, all the variants have the same primary rays,
+        // so we trace them and find their hits only once.
+        float3 rs = float3(0,0,0);
+        float3 rd = float3(0,0,0);
+        RayHitResult hit = (RayHitResult)0;
+        if (share_primary_rays) {
+            get_camera_ray(film_position, random_seed, variant_lens[0].x, variant_lens[0].y, rs, rd);
+            hit = hit_geometry(rd, rs);
+        }
+
+        for (int v = 0; v < variants_count; ++v) {
+            if (!share_primary_rays) {
+                get_camera_ray(film_position, random_seed, variant_lens[v].x, variant_lens[v].y, rs, rd);
+                hit = hit_geometry(rd, rs);
+            }
+
+            ShadingParams params;
+            params.ambient_light_intensity = variant_shading[v].x;
+            params.sphere_lights_intensity = variant_shading[v].y;
+            params.metal_roughness = variant_shading[v].z;
+            params.refractive_index = variant_shading[v].w;
+            final_colors[v] += weight * get_ray_color(rd, rs, hit, random_seed, params, touched);
+        }
+    }
+
+    // Every variant has its own cell in the contact sheet.
+    for (int v = 0; v < variants_count; ++v) {
+        uint2 cell = uint2(v % variants_per_row, v / variants_per_row);
+        uint2 p = cell * uint2(screen_width, screen_height) + pixel;
+        float4 previous = step > 1 ? tex[p] : float4(0,0,0,0);
+        // Sweeps run only a few steps, rounding error is never carried over.
+        float3 compensation = float3(0,0,0);
+        tex[p] = accumulate(previous, tone_map(final_colors[v] / num_samples), compensation);
+    }
+}
+
+#else
+
+// Traces one sample for both eyes. Eyes are parallel cameras separated along camera's x axis and use the same
+// random numbers. Panorama uses omni-directional stereo instead - eyes are offset perpendicular to every ray,
+// shrinking to zero towards the poles, where there's no consistent left and right. When both eyes' rays hit
+// the same diffuse sphere at almost the same point, the light arriving there is the same for both, so the path
+// continues only once and only the first hit's albedo differs. Hits count as the same point when they're within
+// a pixel's footprint of each other, closer than the image can resolve. Both eyes' rays are parallel, so that
+// happens only where the footprint grows to about the eye separation, on far and oblique surfaces.
+void get_stereo_color(float2 film_position, int random_seed, inout uint4 touched, out float3 left, out float3 right) {
+    float3 rs, rd;
+    get_camera_ray(film_position, random_seed, dof_radius, dof_focal_plane, rs, rd);
+    float3 eye_offset = camera_right * 0.5f * eye_separation;
+    if (PANORAMA) {
+        eye_offset = cross(rd, float3(0.0f, 1.0f, 0.0f)) * 0.5f * eye_separation;
+    }
+    float3 rs_left = rs - eye_offset;
+    float3 rs_right = rs + eye_offset;
+    RayHitResult hit_left = hit_tile_spheres(rd, rs_left);
+    RayHitResult hit_right = hit_tile_spheres(rd, rs_right);
+    ShadingParams params = get_shading_params();
+
+    float3 p_left = hit_left.t * rd + rs_left;
+    float3 p_right = hit_right.t * rd + rs_right;
+    // Both eyes' cones are a pixel wide at the hit, footprints differ only by the angle.
+    float2 pixel_cone = get_pixel_cone();
+    float cone_width = pixel_cone.x + pixel_cone.y * hit_left.t;
+    bool is_lambert = hit_left.material == LAMBERT || hit_left.material == LAMBERT_CHECKERBOARD;
+    // Instant radiosity gathers VPLs at the first diffuse hit instead of continuing the path, there's nothing to share.
+    bool shared = !vpl_preview && num_bounces > 1 && hit_left.t > 0.0f && hit_right.t > 0.0f && hit_left.index == hit_right.index &&
+                  is_lambert && distance(p_left, p_right) < cone_width;
+    if (!shared) {
+        if (vpl_preview) {
+            left = get_vpl_color(rd, rs_left, hit_left, random_seed, params, touched);
+            right = get_vpl_color(rd, rs_right, hit_right, random_seed, params, touched);
+        } else {
+            left = get_ray_color(rd, rs_left, hit_left, random_seed, params, touched);
+            right = get_ray_color(rd, rs_right, hit_right, random_seed, params, touched);
+        }
+        return;
+    }
+
+    if (dependency_tracking) {
+        touched[hit_left.index / 32] |= 1u << (hit_left.index % 32);
     }
-    // Average current frame's samples.
-    final_color /= NUM_SAMPLES;
 
-    // Reinhard tone mapping
-    float l = dot(float3(0.2126, 0.7152, 0.0722), final_color);
-    final_color /= l + 1;
+    float3 albedo_left = get_lambert_albedo(hit_left, cone_width / max(abs(dot(rd, hit_left.normal)), 0.05f));
+    float3 albedo_right = get_lambert_albedo(hit_right, cone_width / max(abs(dot(rd, hit_right.normal)), 0.05f));
+
+    // Shared continuation of the path from the left eye's hit.
+    float3 next_rd = sample_lambert(p_left, hit_left.normal, random_seed * 31);
+    float2 cone = float2(cone_width, DIFFUSE_CONE_SPREAD);
+    float3 incoming = trace_path(next_rd, p_left, hit_geometry(next_rd, p_left), random_seed * 13, params, num_bounces - 1, cone, touched);
+    left = albedo_left * incoming;
+    right = albedo_right * incoming;
+}
+
+// Accumulates step's color into pixel p.
+void store_pixel(uint2 p, float3 color, uint4 touched) {
+    // First step overwrites whatever is left from previous rendering.
+    float4 previous = step > 1 ? tex[p] : float4(0,0,0,0);
+#ifdef BATCH_SCENES
+    // Batch scenes run only a few steps, rounding error is never carried over.
+    float3 compensation = float3(0,0,0);
+#else
+    float3 compensation = step > 1 ? accumulation_error[p].rgb : float3(0,0,0);
+#endif
+
+    if (dependency_tracking) {
+        uint4 previous_touched = step > 1 ? dependencies[p] : uint4(0,0,0,0);
+
+        // Restart accumulation if the pixel depends on an edited sphere. Pixel also has to restart if its paths
+        // just reached a moved sphere for the first time - its history was computed without the sphere being there.
+        bool invalidated = any(previous_touched & edited_spheres) || any(touched & moved_spheres & ~previous_touched);
+        if (invalidated) {
+            previous = float4(0,0,0,0);
+            previous_touched = uint4(0,0,0,0);
+            compensation = float3(0,0,0);
+        }
+        dependencies[p] = previous_touched | touched;
+    }
 
     // Average values over time.
-    tex[p] = float4(final_color, 1.0f) / float(step) + tex[p] * float(step - 1) / float(step);
+    tex[p] = accumulate(previous, color, compensation);
+#ifndef BATCH_SCENES
+    accumulation_error[p] = float4(compensation, 0.0f);
+#endif
+}
+
+[numthreads(GROUP_SIZE_X * GROUP_SIZE_Y,1,1)]
+void main(uint groupIndex : SV_GroupIndex, uint3 groupID : SV_GroupID){
+    uint2 p = get_tile_pixel(groupIndex, groupID);
+
+    // Pixel coordinates within the rendered image.
+    uint2 pixel = p;
+#ifdef BATCH_SCENES
+    // Scenes are laid out in a grid, every one of them has screen_width x screen_height pixels.
+    uint2 scene_xy = p / uint2(screen_width, screen_height);
+    uint scene_index = scene_xy.y * scenes_per_row + scene_xy.x;
+    // Grid's last row might not be full, its empty cells have no spheres. Scenes are made of whole tiles,
+    // so the whole group returns together, before any of it reaches a barrier.
+    if (scene_index >= uint(SCENES_COUNT)) {
+        return;
+    }
+    sphere_offset = scene_index * SPHERES_COUNT;
+    pixel = p - scene_xy * uint2(screen_width, screen_height);
+#endif
+    uint2 tile_origin = pixel / uint2(GROUP_SIZE_X, GROUP_SIZE_Y) * uint2(GROUP_SIZE_X, GROUP_SIZE_Y);
+    build_tile_spheres(groupIndex, tile_origin);
+    if (pixel.x >= uint(screen_width) || pixel.y >= uint(screen_height)) {
+        return;
+    }
+
+    // Panorama's pixels cover solid angle proportional to cosine of their latitude,
+    // so rows towards the poles get proportionally fewer samples.
+    int pixel_samples = num_samples;
+    if (PANORAMA) {
+        float latitude = get_panorama_latitude(float(pixel.y) + 0.5f);
+        pixel_samples = max(int(ceil(float(num_samples) * cos(latitude))), 1);
+    }
+
+    // In stereo, screen is the left eye's half of the texture. Right eye's pixel is next to it.
+    float3 final_color = float3(0,0,0);
+    float3 final_color_right = float3(0,0,0);
+    uint4 touched = uint4(0,0,0,0);
+    for (int i = 0; i < pixel_samples; ++i) {
+        // Used for random number generator.
+        int random_seed = p.x * 317 * p.y * 911 * (step * num_samples + i);
+
+        float weight;
+        float2 film_position = sample_film(pixel, random_seed, weight);
+        if (stereo) {
+            float3 left, right;
+            get_stereo_color(film_position, random_seed, touched, left, right);
+            final_color += weight * left;
+            final_color_right += weight * right;
+            continue;
+        }
+
+        float3 rs, rd;
+        get_camera_ray(film_position, random_seed, dof_radius, dof_focal_plane, rs, rd);
+
+        // Get current ray's color.
+        RayHitResult hit = hit_primary(rd, rs, pixel);
+        float3 ray_color = vpl_preview ?
+            get_vpl_color(rd, rs, hit, random_seed, get_shading_params(), touched) :
+            get_ray_color(rd, rs, hit, random_seed, get_shading_params(), touched);
+        final_color += weight * ray_color;
+    }
+    // Average current frame's samples. With negative filter lobes, the average of a few samples can be negative.
+    // It's accumulated as it is, clamping every step would cut the lobes off and blur the edges again.
+    // Only display and image output clamp the result.
+    final_color = final_color / pixel_samples;
+    store_pixel(p, tone_map(final_color), touched);
+
+    if (stereo) {
+        final_color_right = final_color_right / pixel_samples;
+        store_pixel(p + uint2(screen_width, 0), tone_map(final_color_right), touched);
+    }
 }
 
+#endif
@@ -0,0 +1,64 @@
+#include "readback.h"
+#include <cassert>
+
+// Readback lives outside of graphics module, so we get the device and context through the texture.
+static ID3D11DeviceContext *get_context(ID3D11Texture2D *texture) {
+    ID3D11Device *device = NULL;
+    texture->GetDevice(&device);
+    ID3D11DeviceContext *context = NULL;
+    device->GetImmediateContext(&context);
+    device->Release();
+    return context;
+}
+
+ReadbackTexture readback::get(Texture2D *texture) {
+    ReadbackTexture readback = {};
+
+    D3D11_TEXTURE2D_DESC desc;
+    texture->texture->GetDesc(&desc);
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.BindFlags = 0;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    desc.MiscFlags = 0;
+
+    ID3D11Device *device = NULL;
+    texture->texture->GetDevice(&device);
+    HRESULT hr = device->CreateTexture2D(&desc, NULL, &readback.staging);
+    assert(SUCCEEDED(hr));
+    device->Release();
+
+    readback.width = desc.Width;
+    readback.height = desc.Height;
+    return readback;
+}
+
+void readback::release(ReadbackTexture *readback) {
+    if(readback->staging) readback->staging->Release();
+    *readback = {};
+}
+
+void readback::copy(ReadbackTexture *readback, Texture2D *texture) {
+    ID3D11DeviceContext *context = get_context(readback->staging);
+    context->CopyResource(readback->staging, texture->texture);
+    context->Release();
+}
+
+bool readback::map(ReadbackTexture *readback, void **data, int *row_pitch, bool wait) {
+    ID3D11DeviceContext *context = get_context(readback->staging);
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    HRESULT hr = context->Map(readback->staging, 0, D3D11_MAP_READ, wait ? 0 : D3D11_MAP_FLAG_DO_NOT_WAIT, &mapped);
+    context->Release();
+    if(FAILED(hr)) {
+        return false;
+    }
+
+    *data = mapped.pData;
+    *row_pitch = int(mapped.RowPitch);
+    return true;
+}
+
+void readback::unmap(ReadbackTexture *readback) {
+    ID3D11DeviceContext *context = get_context(readback->staging);
+    context->Unmap(readback->staging, 0);
+    context->Release();
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "graphics.h"
+#include <d3d11.h>
+
+// CPU readable copy of a texture. Copy is queued on the GPU and mapped later,
+// so as long as there's other work in between, mapping doesn't stall.
+struct ReadbackTexture {
+    ID3D11Texture2D *staging;
+    int width, height;
+};
+
+namespace readback {
+    ReadbackTexture get(Texture2D *texture);
+    void release(ReadbackTexture *readback);
+
+    // Queues copy of texture's current content.
+    void copy(ReadbackTexture *readback, Texture2D *texture);
+
+    // Maps the last copied content. If wait is false and the copy isn't finished yet, returns false.
+    bool map(ReadbackTexture *readback, void **data, int *row_pitch, bool wait);
+    void unmap(ReadbackTexture *readback);
+}
@@ -0,0 +1,124 @@
+#include "shader_math.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const float PI = 3.14159265f;
+
+// Documented maximum absolute errors, in radians.
+static const double ACOS_MAX_ERROR = 6.8e-5;
+static const double ATAN2_MAX_ERROR = 1.3e-5;
+// Compensated average has to stay this many ulps from the exact average.
+static const double ACCUMULATION_MAX_ULPS = 4.0;
+
+float shader_math::fast_acos(float x) {
+    float a = fabsf(x);
+    float r = sqrtf(1.0f - a) * (1.5707288f + a * (-0.2121144f + a * (0.0742610f - 0.0187293f * a)));
+    return x < 0.0f ? PI - r : r;
+}
+
+float shader_math::fast_asin(float x) {
+    return PI * 0.5f - fast_acos(x);
+}
+
+float shader_math::fast_atan2(float y, float x) {
+    float ax = fabsf(x);
+    float ay = fabsf(y);
+    float largest = ax > ay ? ax : ay;
+    float t = (ax < ay ? ax : ay) / (largest > 1e-30f ? largest : 1e-30f);
+    float t2 = t * t;
+    float r = t * (0.9998660f + t2 * (-0.3302995f + t2 * (0.1801410f + t2 * (-0.0851330f + t2 * 0.0208351f))));
+    if(ay > ax) r = PI * 0.5f - r;
+    if(x < 0.0f) r = PI - r;
+    return y < 0.0f ? -r : r;
+}
+
+void shader_math::accumulate(float *average, float *count, float color, float *compensation) {
+    // Volatile keeps every intermediate rounded to float, as precise does in the shader.
+    volatile float n = *count + 1.0f;
+    volatile float increment = (color - *average) / n - *compensation;
+    volatile float sum = *average + increment;
+    volatile float error = (sum - *average) - increment;
+    *compensation = error;
+    *average = sum;
+    *count = n;
+}
+
+static double get_max_error(const char *name, double max_error, double *worst_input, float (*function)(float), double (*reference)(double)) {
+    const int SAMPLES_COUNT = 1 << 20;
+    double worst = 0.0;
+    for(int i = 0; i <= SAMPLES_COUNT; ++i) {
+        float x = -1.0f + 2.0f * float(i) / float(SAMPLES_COUNT);
+        double error = fabs(double(function(x)) - reference(double(x)));
+        if(error > worst) {
+            worst = error;
+            *worst_input = x;
+        }
+    }
+    printf("%s: max error %.2e, documented %.2e.\n", name, worst, max_error);
+    return worst;
+}
+
+bool shader_math::check() {
+    double input = 0.0;
+    if(get_max_error("fast_acos", ACOS_MAX_ERROR, &input, fast_acos, acos) > ACOS_MAX_ERROR) {
+        printf("fast_acos exceeds its bound at %f.\n", input);
+        return false;
+    }
+    if(get_max_error("fast_asin", ACOS_MAX_ERROR, &input, fast_asin, asin) > ACOS_MAX_ERROR) {
+        printf("fast_asin exceeds its bound at %f.\n", input);
+        return false;
+    }
+
+    // Directions all around the circle, at radii over many orders of magnitude.
+    double atan2_error = 0.0;
+    for(int i = 0; i < (1 << 20); ++i) {
+        double angle = -PI + 2.0 * PI * double(i) / double(1 << 20);
+        float radius = powf(10.0f, float(i % 13) - 6.0f);
+        float y = float(sin(angle)) * radius;
+        float x = float(cos(angle)) * radius;
+        double error = fabs(double(fast_atan2(y, x)) - atan2(double(y), double(x)));
+        // Angle just below pi can round to -pi when y flushes to -0, both mean the same direction.
+        if(error > PI) error = fabs(error - 2.0 * PI);
+        if(error > atan2_error) atan2_error = error;
+    }
+    printf("fast_atan2: max error %.2e, documented %.2e.\n", atan2_error, ATAN2_MAX_ERROR);
+    if(atan2_error > ATAN2_MAX_ERROR) return false;
+
+    // Pixels of different brightness and noise, the documented case is an average around 0.5 with steps 5% off.
+    struct Sequence {
+        float mean;
+        float noise;
+    };
+    Sequence sequences[] = {{0.5f, 0.05f}, {0.5f, 0.5f}, {0.05f, 0.05f}, {0.9f, 0.1f}};
+    const int STEPS_COUNT = 1 << 22;
+    srand(1);
+    for(int s = 0; s < int(sizeof(sequences) / sizeof(sequences[0])); ++s) {
+        float naive = 0.0f, naive_count = 0.0f, naive_compensation = 0.0f;
+        float compensated = 0.0f, count = 0.0f, compensation = 0.0f;
+        double sum = 0.0;
+        for(int step = 1; step <= STEPS_COUNT; ++step) {
+            float random = float(rand()) / float(RAND_MAX) * 2.0f - 1.0f;
+            float color = sequences[s].mean * (1.0f + sequences[s].noise * random);
+            sum += double(color);
+            accumulate(&compensated, &count, color, &compensation);
+            // Without compensation, as if it was always thrown away.
+            accumulate(&naive, &naive_count, color, &naive_compensation);
+            naive_compensation = 0.0f;
+        }
+        double exact = sum / double(STEPS_COUNT);
+        int exponent;
+        frexp(exact, &exponent);
+        double ulp = ldexp(1.0, exponent - 24);
+        double compensated_ulps = fabs(double(compensated) - exact) / ulp;
+        double naive_ulps = fabs(double(naive) - exact) / ulp;
+        printf("Average %.2f with %.0f%% noise after %d steps: compensated error %.2f ulps, plain %.1f ulps.\n",
+               sequences[s].mean, sequences[s].noise * 100.0f, STEPS_COUNT, compensated_ulps, naive_ulps);
+        if(compensated_ulps > ACCUMULATION_MAX_ULPS || count != float(STEPS_COUNT)) {
+            printf("Compensated accumulation exceeds its bound of %.0f ulps.\n", ACCUMULATION_MAX_ULPS);
+            return false;
+        }
+    }
+    printf("Shader math check passed.\n");
+    return true;
+}
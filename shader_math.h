@@ -0,0 +1,18 @@
+#pragma once
+
+// CPU copies of ray tracing shader's fast math and accumulation, operation by operation, so their documented
+// error bounds can be checked without a GPU. Changes to these functions in ray_trace_shader.hlsl have to be
+// mirrored here.
+namespace shader_math {
+    float fast_acos(float x);
+    float fast_asin(float x);
+    float fast_atan2(float y, float x);
+
+    // Single channel of accumulate. Count is the number of steps already in the average.
+    void accumulate(float *average, float *count, float color, float *compensation);
+
+    // Headless check of the documented bounds. Fast math functions are compared against the standard library
+    // over their whole domain. Long random sequences are accumulated both with and without compensation,
+    // compensated average has to stay within a few ulps of the exact one. Prints the first failure.
+    bool check();
+}
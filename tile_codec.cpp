@@ -0,0 +1,101 @@
+#include "tile_codec.h"
+#include <cassert>
+#include <string.h>
+
+static const int MAX_TILE_BYTES = TILE_CODEC_MAX_TILE_SIZE * TILE_CODEC_MAX_TILE_SIZE * 3;
+
+void tile_codec::quantize(uint8_t *output, float *pixels, int width, int height, int row_pitch) {
+    for(int y = 0; y < height; ++y) {
+        float *row = (float *)((uint8_t *)pixels + size_t(y) * row_pitch);
+        for(int x = 0; x < width; ++x) {
+            for(int c = 0; c < 3; ++c) {
+                float value = row[x * 4 + c];
+                value = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+                *output++ = uint8_t(value * 255.0f + 0.5f);
+            }
+        }
+    }
+}
+
+int tile_codec::get_max_difference(uint8_t *current, uint8_t *previous, int frame_width, int x, int y, int width, int height) {
+    int max_difference = 0;
+    for(int j = 0; j < height; ++j) {
+        size_t offset = (size_t(y + j) * frame_width + x) * 3;
+        for(int i = 0; i < width * 3; ++i) {
+            int difference = int(current[offset + i]) - int(previous[offset + i]);
+            if(difference < 0) difference = -difference;
+            if(difference > max_difference) max_difference = difference;
+        }
+    }
+    return max_difference;
+}
+
+size_t tile_codec::encode(uint8_t *output, uint8_t *current, uint8_t *previous, int frame_width, int x, int y, int width, int height) {
+    assert(width <= TILE_CODEC_MAX_TILE_SIZE && height <= TILE_CODEC_MAX_TILE_SIZE);
+
+    // Tile's deltas as one contiguous array.
+    uint8_t deltas[MAX_TILE_BYTES];
+    size_t count = 0;
+    for(int j = 0; j < height; ++j) {
+        size_t offset = (size_t(y + j) * frame_width + x) * 3;
+        for(int i = 0; i < width * 3; ++i) {
+            deltas[count++] = uint8_t(current[offset + i] - previous[offset + i]);
+        }
+    }
+
+    uint8_t *out = output;
+    size_t i = 0;
+    while(i < count) {
+        // Runs of at least two zeros are worth a control byte.
+        size_t run = 0;
+        while(i + run < count && deltas[i + run] == 0 && run < 129) run++;
+        if(run >= 2) {
+            *out++ = uint8_t(126 + run);
+            i += run;
+            continue;
+        }
+
+        // Literals up to the next pair of zeros.
+        size_t start = i;
+        while(i < count && i - start < 128 && !(deltas[i] == 0 && i + 1 < count && deltas[i + 1] == 0)) i++;
+        size_t length = i - start;
+        *out++ = uint8_t(length - 1);
+        memcpy(out, deltas + start, length);
+        out += length;
+    }
+    return size_t(out - output);
+}
+
+size_t tile_codec::decode(uint8_t *frame, int frame_width, int x, int y, int width, int height, uint8_t *input, size_t input_size) {
+    if(width > TILE_CODEC_MAX_TILE_SIZE || height > TILE_CODEC_MAX_TILE_SIZE) return 0;
+
+    uint8_t deltas[MAX_TILE_BYTES];
+    size_t count = size_t(width) * height * 3;
+    size_t written = 0;
+    size_t read = 0;
+    while(written < count) {
+        if(read >= input_size) return 0;
+        uint8_t control = input[read++];
+        if(control >= 128) {
+            size_t run = size_t(control) - 126;
+            if(written + run > count) return 0;
+            memset(deltas + written, 0, run);
+            written += run;
+        } else {
+            size_t length = size_t(control) + 1;
+            if(written + length > count || read + length > input_size) return 0;
+            memcpy(deltas + written, input + read, length);
+            written += length;
+            read += length;
+        }
+    }
+
+    size_t index = 0;
+    for(int j = 0; j < height; ++j) {
+        size_t offset = (size_t(y + j) * frame_width + x) * 3;
+        for(int i = 0; i < width * 3; ++i) {
+            frame[offset + i] = uint8_t(frame[offset + i] + deltas[index++]);
+        }
+    }
+    return read;
+}
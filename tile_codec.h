@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Largest tile edge the codec handles.
+#define TILE_CODEC_MAX_TILE_SIZE 64
+// Upper bound on encoded size of a tile with given number of bytes. Every 128 literal bytes need a control byte.
+#define TILE_CODEC_MAX_ENCODED_SIZE(bytes) ((bytes) + ((bytes) + 127) / 128)
+
+// Delta compression of RGB8 frame tiles for preview streaming. Tile is encoded as byte-wise difference
+// (modulo 256) between its current and previous version, rows concatenated, with runs of zeros compressed.
+// Encoded stream is a sequence of control bytes, each followed by its data:
+// - c < 128: c + 1 literal bytes follow,
+// - c >= 128: run of c - 126 zero bytes, nothing follows.
+// Unchanged pixels are exactly zero after quantization, so a converging image compresses well.
+namespace tile_codec {
+    // Quantizes RGBA float pixels, clamped to [0,1], into tightly packed RGB8.
+    void quantize(uint8_t *output, float *pixels, int width, int height, int row_pitch);
+
+    // Largest difference of any channel between current and previous frame within the tile.
+    int get_max_difference(uint8_t *current, uint8_t *previous, int frame_width, int x, int y, int width, int height);
+
+    // Encodes tile at (x, y) of given size in pixels. Returns number of bytes written to output.
+    size_t encode(uint8_t *output, uint8_t *current, uint8_t *previous, int frame_width, int x, int y, int width, int height);
+    // Applies encoded tile onto frame. Returns number of bytes consumed, or zero if input is malformed.
+    size_t decode(uint8_t *frame, int frame_width, int x, int y, int width, int height, uint8_t *input, size_t input_size);
+}
@@ -0,0 +1,239 @@
+#include "tile_scheduler.h"
+#include <cassert>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// Upper limit on how many full steps we trace per frame.
+static const int MAX_STEPS_PER_FRAME = 8;
+
+TileScheduler tile_scheduler::get(Arena *arena, int tiles_x, int tiles_y, float target_frame_time) {
+    TileScheduler scheduler = {};
+    scheduler.tiles_count = tiles_x * tiles_y;
+    scheduler.tiles = arena::push_array<uint32_t>(arena, scheduler.tiles_count);
+    scheduler.order = arena::push_array<uint32_t>(arena, scheduler.tiles_count);
+    scheduler.sort_keys = arena::push_array<uint64_t>(arena, scheduler.tiles_count);
+    assert(scheduler.tiles && scheduler.order && scheduler.sort_keys);
+
+    // Raster order.
+    for(int y = 0; y < tiles_y; ++y) {
+        for(int x = 0; x < tiles_x; ++x) {
+            scheduler.order[y * tiles_x + x] = uint32_t(x) | (uint32_t(y) << 16);
+        }
+    }
+    memcpy(scheduler.tiles, scheduler.order, scheduler.tiles_count * sizeof(uint32_t));
+
+    scheduler.target_frame_time = target_frame_time;
+    scheduler.work_per_frame = 0.0f;
+    return scheduler;
+}
+
+void tile_scheduler::invalidate(TileScheduler *scheduler) {
+    scheduler->next_tile = 0;
+    scheduler->preview_pending = true;
+}
+
+static bool is_in_region(TileScheduler *scheduler, uint32_t tile) {
+    int x = int(tile & 0xFFFF);
+    int y = int(tile >> 16);
+    return x >= scheduler->region_x0 && x < scheduler->region_x1 && y >= scheduler->region_y0 && y < scheduler->region_y1;
+}
+
+// Rebuilds tiles from the order, region's tiles first. Tiles of a step in progress would move,
+// so it's done only between steps.
+static void build_tiles(TileScheduler *scheduler) {
+    assert(scheduler->next_tile == 0);
+    scheduler->tiles_dirty = false;
+    if(!scheduler->has_region) {
+        memcpy(scheduler->tiles, scheduler->order, scheduler->tiles_count * sizeof(uint32_t));
+        scheduler->region_tiles_count = 0;
+        return;
+    }
+
+    // Stable partition, both parts keep the order.
+    int count = 0;
+    for(int i = 0; i < scheduler->tiles_count; ++i) {
+        if(is_in_region(scheduler, scheduler->order[i])) scheduler->tiles[count++] = scheduler->order[i];
+    }
+    scheduler->region_tiles_count = count;
+    for(int i = 0; i < scheduler->tiles_count; ++i) {
+        if(!is_in_region(scheduler, scheduler->order[i])) scheduler->tiles[count++] = scheduler->order[i];
+    }
+    assert(count == scheduler->tiles_count);
+}
+
+void tile_scheduler::set_region(TileScheduler *scheduler, int x0, int y0, int x1, int y1) {
+    scheduler->has_region = true;
+    scheduler->region_x0 = x0;
+    scheduler->region_y0 = y0;
+    scheduler->region_x1 = x1;
+    scheduler->region_y1 = y1;
+    scheduler->tiles_dirty = true;
+}
+
+void tile_scheduler::clear_region(TileScheduler *scheduler) {
+    scheduler->has_region = false;
+    scheduler->tiles_dirty = true;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    uint64_t key_a = *(uint64_t *)a;
+    uint64_t key_b = *(uint64_t *)b;
+    return key_a < key_b ? -1 : (key_a > key_b ? 1 : 0);
+}
+
+void tile_scheduler::order_by_distance(TileScheduler *scheduler, float x, float y) {
+    // Distances are measured in half tiles, so tile centers have integer coordinates.
+    int cx = int(x * 2.0f);
+    int cy = int(y * 2.0f);
+    for(int i = 0; i < scheduler->tiles_count; ++i) {
+        uint32_t tile = scheduler->order[i];
+        int64_t dx = int64_t(tile & 0xFFFF) * 2 + 1 - cx;
+        int64_t dy = int64_t(tile >> 16) * 2 + 1 - cy;
+        // Ties are broken by the packed tile, which gives raster order.
+        scheduler->sort_keys[i] = uint64_t(dx * dx + dy * dy) << 32 | (uint64_t(tile >> 16) << 16 | (tile & 0xFFFF));
+    }
+    qsort(scheduler->sort_keys, scheduler->tiles_count, sizeof(uint64_t), compare_keys);
+    for(int i = 0; i < scheduler->tiles_count; ++i) {
+        scheduler->order[i] = uint32_t(scheduler->sort_keys[i] & 0xFFFFFFFF);
+    }
+    scheduler->tiles_dirty = true;
+}
+
+void tile_scheduler::swap_tiles(TileScheduler *a, TileScheduler *b) {
+    TileScheduler tmp = *a;
+    a->tiles = b->tiles;
+    a->order = b->order;
+    a->sort_keys = b->sort_keys;
+    a->tiles_count = b->tiles_count;
+    b->tiles = tmp.tiles;
+    b->order = tmp.order;
+    b->sort_keys = tmp.sort_keys;
+    b->tiles_count = tmp.tiles_count;
+    a->next_tile = 0;
+    b->next_tile = 0;
+    clear_region(a);
+    clear_region(b);
+}
+
+void tile_scheduler::update_budget(TileScheduler *scheduler, float frame_time) {
+    // Back off quickly when over budget, grow slowly otherwise.
+    if(frame_time > scheduler->target_frame_time) {
+        scheduler->work_per_frame *= 0.8f;
+    } else {
+        scheduler->work_per_frame *= 1.1f;
+    }
+}
+
+int tile_scheduler::get_frame_budget(TileScheduler *scheduler, float tile_cost) {
+    // Start from a single step per frame.
+    if(scheduler->work_per_frame <= 0.0f) {
+        scheduler->work_per_frame = scheduler->tiles_count * tile_cost;
+    }
+
+    // Always trace at least one tile, but never more than few steps per frame.
+    float min_work = tile_cost;
+    float max_work = scheduler->tiles_count * MAX_STEPS_PER_FRAME * tile_cost;
+    if(scheduler->work_per_frame < min_work) scheduler->work_per_frame = min_work;
+    if(scheduler->work_per_frame > max_work) scheduler->work_per_frame = max_work;
+
+    return int(scheduler->work_per_frame / tile_cost);
+}
+
+TileBatch tile_scheduler::next_batch(TileScheduler *scheduler, int max_tiles) {
+    TileBatch batch;
+    batch.starts_step = scheduler->next_tile == 0;
+    if(batch.starts_step) {
+        // Step in progress always finishes with the tiles it started with. Otherwise the part of the image
+        // it hadn't reached yet would be left behind, or traced twice, by the new order.
+        if(scheduler->tiles_dirty) build_tiles(scheduler);
+        bool region_step = scheduler->region_tiles_count > 0 && !scheduler->preview_pending;
+        scheduler->step_tiles_count = region_step ? scheduler->region_tiles_count : scheduler->tiles_count;
+        scheduler->preview_pending = false;
+    }
+    batch.tiles = scheduler->tiles + scheduler->next_tile;
+    batch.tiles_count = scheduler->step_tiles_count - scheduler->next_tile;
+    if(batch.tiles_count > max_tiles) batch.tiles_count = max_tiles;
+
+    scheduler->next_tile += batch.tiles_count;
+    if(scheduler->next_tile == scheduler->step_tiles_count) {
+        scheduler->next_tile = 0;
+    }
+    return batch;
+}
+
+bool tile_scheduler::check(Arena *arena, int frames_count) {
+    const int tiles_x = 13, tiles_y = 7;
+    TileScheduler scheduler = get(arena, tiles_x, tiles_y, 1.0f / 60.0f);
+    // Times each tile was traced in the current step.
+    int *traced = arena::push_array<int>(arena, scheduler.tiles_count);
+    assert(traced);
+
+    // Fixed seed, so failures reproduce.
+    srand(1);
+    invalidate(&scheduler);
+    bool preview_step = false;
+    bool region_step = false;
+    int region_x0 = 0, region_y0 = 0, region_x1 = 0, region_y1 = 0;
+    int steps_count = 0;
+    for(int frame = 0; frame < frames_count; ++frame) {
+        // Stub presenter, frames take random time around the target.
+        update_budget(&scheduler, scheduler.target_frame_time * (0.5f + float(rand()) / RAND_MAX));
+        int budget = get_frame_budget(&scheduler, 1.0f);
+        while(budget > 0) {
+            TileBatch batch = next_batch(&scheduler, 1 + rand() % 16);
+            if(batch.starts_step) {
+                // Verify the previous step. Step that was interrupted by invalidation is dropped, not verified.
+                if(steps_count > 0) {
+                    for(int i = 0; i < scheduler.tiles_count; ++i) {
+                        int x = i % tiles_x, y = i / tiles_x;
+                        bool in_region = x >= region_x0 && x < region_x1 && y >= region_y0 && y < region_y1;
+                        int expected = (!region_step || in_region) ? 1 : 0;
+                        if(traced[i] != expected) {
+                            printf("Step %d traced tile (%d, %d) %d times instead of %d.\n", steps_count, x, y, traced[i], expected);
+                            return false;
+                        }
+                    }
+                }
+                if(preview_step && scheduler.step_tiles_count != scheduler.tiles_count) {
+                    printf("Step %d after invalidation doesn't trace all tiles.\n", steps_count + 1);
+                    return false;
+                }
+                memset(traced, 0, scheduler.tiles_count * sizeof(int));
+                region_step = scheduler.step_tiles_count < scheduler.tiles_count;
+                region_x0 = scheduler.region_x0;
+                region_y0 = scheduler.region_y0;
+                region_x1 = scheduler.region_x1;
+                region_y1 = scheduler.region_y1;
+                preview_step = false;
+                steps_count++;
+            }
+            for(int i = 0; i < batch.tiles_count; ++i) {
+                traced[(batch.tiles[i] >> 16) * tiles_x + (batch.tiles[i] & 0xFFFF)]++;
+            }
+            budget -= batch.tiles_count;
+        }
+
+        // Input events between frames.
+        switch(rand() % 16) {
+            case 0:
+                invalidate(&scheduler);
+                preview_step = true;
+                steps_count = 0;
+                break;
+            case 1: {
+                int x0 = rand() % tiles_x, y0 = rand() % tiles_y;
+                set_region(&scheduler, x0, y0, x0 + 1 + rand() % (tiles_x - x0), y0 + 1 + rand() % (tiles_y - y0));
+                break;
+            }
+            case 2:
+                clear_region(&scheduler);
+                break;
+            case 3:
+                order_by_distance(&scheduler, float(rand() % (tiles_x * 4)) * 0.25f, float(rand() % (tiles_y * 4)) * 0.25f);
+                break;
+        }
+    }
+    printf("Scheduler check passed, %d frames.\n", frames_count);
+    return true;
+}
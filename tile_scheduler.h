@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include "arena.h"
+
+// Splits ray tracing steps into batches of tiles, so a single frame never has to wait for the whole image.
+// Expensive settings then take several frames per step while input and presentation keep running
+// at interactive rate, cheap ones fit several steps into a single frame.
+struct TileScheduler {
+    // Tile coordinates packed as x | y << 16, in the order they're traced.
+    uint32_t *tiles;
+    int tiles_count;
+    // Tile order without render region, tiles are rebuilt from it whenever the order or the region changes.
+    uint32_t *order;
+    // Order or region changed, tiles are rebuilt when the next step starts.
+    bool tiles_dirty;
+    // Scratch space for sorting the order.
+    uint64_t *sort_keys;
+    // Position of the next tile within the current step.
+    int next_tile;
+    // Number of tiles traced in the current step.
+    int step_tiles_count;
+
+    // Render region's tiles are at the front of tiles. Zero if the whole image is rendered.
+    int region_tiles_count;
+    bool has_region;
+    int region_x0, region_y0, region_x1, region_y1;
+    // The first step after invalidation traces all tiles, so the image outside of the region gets a preview.
+    bool preview_pending;
+
+    // Amount of work traced per frame, adapted to hit the target frame time.
+    float work_per_frame;
+    float target_frame_time;
+};
+
+struct TileBatch {
+    uint32_t *tiles;
+    int tiles_count;
+    bool starts_step;
+};
+
+namespace tile_scheduler {
+    TileScheduler get(Arena *arena, int tiles_x, int tiles_y, float target_frame_time);
+
+    // Restarts scheduling from the first tile.
+    void invalidate(TileScheduler *scheduler);
+
+    // Restricts steps to tiles within [x0, x1) x [y0, y1), in tiles. Pixels outside keep their current state.
+    // Takes effect from the next step.
+    void set_region(TileScheduler *scheduler, int x0, int y0, int x1, int y1);
+    void clear_region(TileScheduler *scheduler);
+
+    // Orders tiles by distance of their centers from point (x, y), in tiles, the closest ones first.
+    // Every step still traces all the tiles (or the whole region), only in different order,
+    // so the order decides which parts of the image update first and no tile is ever starved.
+    // Takes effect from the next step.
+    void order_by_distance(TileScheduler *scheduler, float x, float y);
+
+    // Exchanges tile lists of two schedulers, budget stays. Regions are cleared and steps in progress restart,
+    // as they were tracing a different grid.
+    void swap_tiles(TileScheduler *a, TileScheduler *b);
+
+    // Adapts amount of work per frame based on the last frame's duration.
+    // When the GPU is the bottleneck, frame time is a good proxy for GPU time.
+    void update_budget(TileScheduler *scheduler, float frame_time);
+    // Returns number of tiles to trace this frame, given cost of a single tile in arbitrary units.
+    int get_frame_budget(TileScheduler *scheduler, float tile_cost);
+
+    // Returns batch of at most max_tiles tiles. Batch never crosses step boundary.
+    TileBatch next_batch(TileScheduler *scheduler, int max_tiles);
+
+    // Headless check of the scheduling, no GPU or window involved. Drives a scheduler the way the render loop does,
+    // with random frame times, invalidations, regions and orders, and verifies that every step traces each of its
+    // tiles exactly once: all tiles after invalidation, only the region's tiles otherwise. Prints the first failure.
+    bool check(Arena *arena, int frames_count);
+}
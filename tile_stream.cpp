@@ -0,0 +1,245 @@
+#include <winsock2.h>
+#include "tile_stream.h"
+#include "tile_codec.h"
+#include <cassert>
+#include <string.h>
+
+// Default rate limit, lower bandwidth slows updates down further.
+static const float STREAM_MAX_UPDATES_PER_SECOND = 10.0f;
+
+static void drop_client(TileStream *stream) {
+    closesocket(SOCKET(stream->client));
+    stream->client = uintptr_t(INVALID_SOCKET);
+    stream->message_size = 0;
+    stream->message_sent = 0;
+}
+
+// 32-bit FNV-1a.
+static uint32_t get_checksum(uint8_t *data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Sends as much of the current message as the socket takes without blocking.
+static void flush(TileStream *stream) {
+    while(stream->client != uintptr_t(INVALID_SOCKET) && stream->message_sent < stream->message_size) {
+        size_t remaining = stream->message_size - stream->message_sent;
+        int chunk = remaining > (1 << 30) ? (1 << 30) : int(remaining);
+        int sent = send(SOCKET(stream->client), (char *)stream->message + stream->message_sent, chunk, 0);
+        if(sent == SOCKET_ERROR) {
+            // Full socket buffer means the link is slower than the updates, the rest goes out in later frames.
+            if(WSAGetLastError() != WSAEWOULDBLOCK) drop_client(stream);
+            return;
+        }
+        stream->message_sent += size_t(sent);
+        stream->bytes_sent += uint64_t(sent);
+    }
+}
+
+bool tile_stream::get(TileStream *stream, Arena *arena, int port, int width, int height, int tile_size) {
+    assert(tile_size <= TILE_CODEC_MAX_TILE_SIZE);
+    *stream = {};
+    stream->listener = uintptr_t(INVALID_SOCKET);
+    stream->client = uintptr_t(INVALID_SOCKET);
+    stream->width = width;
+    stream->height = height;
+    stream->tile_size = tile_size;
+    stream->min_interval = 1.0f / STREAM_MAX_UPDATES_PER_SECOND;
+
+    WSADATA wsa_data;
+    if(WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) return false;
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(listener == INVALID_SOCKET) {
+        WSACleanup();
+        return false;
+    }
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(u_short(port));
+    u_long non_blocking = 1;
+    if(bind(listener, (sockaddr *)&address, sizeof(address)) == SOCKET_ERROR || listen(listener, 1) == SOCKET_ERROR ||
+       ioctlsocket(listener, FIONBIO, &non_blocking) == SOCKET_ERROR) {
+        closesocket(listener);
+        WSACleanup();
+        return false;
+    }
+    stream->listener = uintptr_t(listener);
+
+    size_t frame_size = size_t(width) * height * 3;
+    stream->frame = arena::push_array<uint8_t>(arena, frame_size);
+    stream->client_frame = arena::push_array<uint8_t>(arena, frame_size);
+
+    // Worst case update has every tile, none of them compressible.
+    int tiles_count = ((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size);
+    stream->message_capacity = sizeof(StreamHeader) + sizeof(UpdateHeader) +
+        size_t(tiles_count) * (sizeof(TileHeader) + TILE_CODEC_MAX_ENCODED_SIZE(size_t(tile_size) * tile_size * 3));
+    stream->message = arena::push_array<uint8_t>(arena, stream->message_capacity);
+    assert(stream->frame && stream->client_frame && stream->message);
+    return true;
+}
+
+void tile_stream::release(TileStream *stream) {
+    if(stream->listener == uintptr_t(INVALID_SOCKET)) return;
+    if(stream->client != uintptr_t(INVALID_SOCKET)) drop_client(stream);
+    closesocket(SOCKET(stream->listener));
+    stream->listener = uintptr_t(INVALID_SOCKET);
+    WSACleanup();
+}
+
+void tile_stream::poll(TileStream *stream, float dt) {
+    stream->time_since_update += dt;
+
+    // Only one client at a time, others are turned away.
+    SOCKET accepted = accept(SOCKET(stream->listener), NULL, NULL);
+    if(accepted != INVALID_SOCKET) {
+        if(stream->client != uintptr_t(INVALID_SOCKET)) {
+            closesocket(accepted);
+        } else {
+            u_long non_blocking = 1;
+            ioctlsocket(accepted, FIONBIO, &non_blocking);
+            BOOL no_delay = TRUE;
+            setsockopt(accepted, IPPROTO_TCP, TCP_NODELAY, (char *)&no_delay, sizeof(no_delay));
+            stream->client = uintptr_t(accepted);
+            stream->bytes_sent = 0;
+
+            // New client has nothing, so the first update carries the whole frame.
+            memset(stream->client_frame, 0, size_t(stream->width) * stream->height * 3);
+            StreamHeader header = {STREAM_MAGIC, STREAM_VERSION, uint32_t(stream->width), uint32_t(stream->height), uint32_t(stream->tile_size)};
+            memcpy(stream->message, &header, sizeof(header));
+            stream->message_size = sizeof(header);
+            stream->message_sent = 0;
+        }
+    }
+
+    flush(stream);
+}
+
+bool tile_stream::wants_frame(TileStream *stream) {
+    return stream->client != uintptr_t(INVALID_SOCKET) && stream->message_sent == stream->message_size &&
+           stream->time_since_update >= stream->min_interval;
+}
+
+void tile_stream::push_frame(TileStream *stream, float *pixels, int row_pitch, uint32_t step) {
+    if(!wants_frame(stream)) return;
+    stream->time_since_update = 0.0f;
+    tile_codec::quantize(stream->frame, pixels, stream->width, stream->height, row_pitch);
+
+    // Tiles that changed meaningfully since the client got them, each encoded against the client's version.
+    uint8_t *out = stream->message + sizeof(UpdateHeader);
+    UpdateHeader update = {step, 0, 0};
+    for(int y = 0; y < stream->height; y += stream->tile_size) {
+        for(int x = 0; x < stream->width; x += stream->tile_size) {
+            int width = stream->width - x < stream->tile_size ? stream->width - x : stream->tile_size;
+            int height = stream->height - y < stream->tile_size ? stream->height - y : stream->tile_size;
+            int difference = tile_codec::get_max_difference(stream->frame, stream->client_frame, stream->width, x, y, width, height);
+            if(difference < STREAM_TILE_THRESHOLD) continue;
+
+            TileHeader tile = {uint16_t(x / stream->tile_size), uint16_t(y / stream->tile_size), 0};
+            uint8_t *tile_data = out + sizeof(TileHeader);
+            tile.size = uint32_t(tile_codec::encode(tile_data, stream->frame, stream->client_frame, stream->width, x, y, width, height));
+            memcpy(out, &tile, sizeof(tile));
+            out = tile_data + tile.size;
+            update.tiles_count++;
+
+            // Client decodes the tile exactly to the current frame's values.
+            for(int j = 0; j < height; ++j) {
+                size_t offset = (size_t(y + j) * stream->width + x) * 3;
+                memcpy(stream->client_frame + offset, stream->frame + offset, size_t(width) * 3);
+            }
+        }
+    }
+    if(update.tiles_count == 0) return;
+    update.frame_checksum = get_checksum(stream->client_frame, size_t(stream->width) * stream->height * 3);
+
+    memcpy(stream->message, &update, sizeof(update));
+    stream->message_size = size_t(out - stream->message);
+    stream->message_sent = 0;
+    flush(stream);
+}
+
+// Receives exactly size bytes. Returns false if the connection closed.
+static bool receive_all(TileStreamClient *client, void *data, size_t size) {
+    uint8_t *out = (uint8_t *)data;
+    while(size > 0) {
+        int chunk = size > (1 << 30) ? (1 << 30) : int(size);
+        int received = recv(SOCKET(client->socket), (char *)out, chunk, 0);
+        if(received <= 0) return false;
+        out += received;
+        size -= size_t(received);
+        client->bytes_received += uint64_t(received);
+    }
+    return true;
+}
+
+bool tile_stream::connect(TileStreamClient *client, Arena *arena, int port) {
+    *client = {};
+    client->socket = uintptr_t(INVALID_SOCKET);
+
+    WSADATA wsa_data;
+    if(WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) return false;
+    SOCKET client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(client_socket == INVALID_SOCKET) {
+        WSACleanup();
+        return false;
+    }
+    client->socket = uintptr_t(client_socket);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(u_short(port));
+    StreamHeader header;
+    if(::connect(client_socket, (sockaddr *)&address, sizeof(address)) == SOCKET_ERROR || !receive_all(client, &header, sizeof(header)) ||
+       header.magic != STREAM_MAGIC || header.version != STREAM_VERSION ||
+       header.tile_size == 0 || header.tile_size > TILE_CODEC_MAX_TILE_SIZE) {
+        disconnect(client);
+        return false;
+    }
+
+    client->width = int(header.width);
+    client->height = int(header.height);
+    client->tile_size = int(header.tile_size);
+    size_t frame_size = size_t(header.width) * header.height * 3;
+    client->frame = arena::push_array<uint8_t>(arena, frame_size);
+    client->tile_data_capacity = TILE_CODEC_MAX_ENCODED_SIZE(size_t(header.tile_size) * header.tile_size * 3);
+    client->tile_data = arena::push_array<uint8_t>(arena, client->tile_data_capacity);
+    if(!client->frame || !client->tile_data) {
+        disconnect(client);
+        return false;
+    }
+    memset(client->frame, 0, frame_size);
+    return true;
+}
+
+void tile_stream::disconnect(TileStreamClient *client) {
+    if(client->socket == uintptr_t(INVALID_SOCKET)) return;
+    closesocket(SOCKET(client->socket));
+    client->socket = uintptr_t(INVALID_SOCKET);
+    WSACleanup();
+}
+
+StreamReceiveResult tile_stream::receive(TileStreamClient *client, UpdateHeader *update) {
+    if(!receive_all(client, update, sizeof(UpdateHeader))) return STREAM_CLOSED;
+
+    int tiles_x = (client->width + client->tile_size - 1) / client->tile_size;
+    int tiles_y = (client->height + client->tile_size - 1) / client->tile_size;
+    for(uint32_t i = 0; i < update->tiles_count; ++i) {
+        TileHeader tile;
+        if(!receive_all(client, &tile, sizeof(tile))) return STREAM_CLOSED;
+        if(tile.x >= tiles_x || tile.y >= tiles_y || tile.size > client->tile_data_capacity) return STREAM_INVALID;
+        if(!receive_all(client, client->tile_data, tile.size)) return STREAM_CLOSED;
+
+        int x = int(tile.x) * client->tile_size;
+        int y = int(tile.y) * client->tile_size;
+        int width = client->width - x < client->tile_size ? client->width - x : client->tile_size;
+        int height = client->height - y < client->tile_size ? client->height - y : client->tile_size;
+        size_t consumed = tile_codec::decode(client->frame, client->width, x, y, width, height, client->tile_data, tile.size);
+        if(consumed != tile.size) return STREAM_INVALID;
+    }
+
+    uint32_t checksum = get_checksum(client->frame, size_t(client->width) * client->height * 3);
+    return checksum == update->frame_checksum ? STREAM_RECEIVED : STREAM_INVALID;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "arena.h"
+
+// Progressive preview streaming over TCP. A single client connects to the port, receives StreamHeader and then
+// updates with tiles that changed since the client's version of them by at least STREAM_TILE_THRESHOLD levels.
+// Update is UpdateHeader followed by tiles_count pairs of TileHeader and tile encoded by tile_codec, against
+// the tile's previous version the client has. Client's frame starts black, RGB8, row-major. All values little-endian.
+// After applying an update, client's whole frame hashes to the update's frame_checksum (32-bit FNV-1a).
+// A new update is built only after the previous one was fully sent, so the update rate adapts to the bandwidth.
+#define STREAM_MAGIC 0x53545452 // "RTTS"
+#define STREAM_VERSION 2
+// Tiles changed by less than this many quantization levels are not sent.
+#define STREAM_TILE_THRESHOLD 2
+
+struct StreamHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_size;
+};
+
+struct UpdateHeader {
+    // Rendering step of the frame the update comes from.
+    uint32_t step;
+    uint32_t tiles_count;
+    // Checksum of client's frame with the update applied.
+    uint32_t frame_checksum;
+};
+
+struct TileHeader {
+    // Tile's coordinates in tiles.
+    uint16_t x, y;
+    // Size of the encoded tile in bytes.
+    uint32_t size;
+};
+
+struct TileStream {
+    // Winsock sockets, kept as integers so the header doesn't pull winsock2.h in before windows.h.
+    uintptr_t listener;
+    uintptr_t client;
+    int width, height, tile_size;
+
+    // Current frame and frame as the client has it, both quantized.
+    uint8_t *frame;
+    uint8_t *client_frame;
+
+    // Message being sent.
+    uint8_t *message;
+    size_t message_capacity;
+    size_t message_size;
+    size_t message_sent;
+
+    // Updates are sent at most this often, in seconds.
+    float min_interval;
+    float time_since_update;
+
+    // Total bytes sent to the current client.
+    uint64_t bytes_sent;
+};
+
+// Receiving side of the stream, used to watch and verify the stream from another process.
+struct TileStreamClient {
+    uintptr_t socket;
+    int width, height, tile_size;
+    // Frame as received so far, RGB8.
+    uint8_t *frame;
+    // Single encoded tile.
+    uint8_t *tile_data;
+    size_t tile_data_capacity;
+    // Total bytes received.
+    uint64_t bytes_received;
+};
+
+enum StreamReceiveResult {
+    STREAM_RECEIVED,
+    STREAM_CLOSED,
+    // Update is malformed or the frame doesn't match its checksum.
+    STREAM_INVALID,
+};
+
+namespace tile_stream {
+    // Starts listening on port on all interfaces. Returns false if the port can't be opened.
+    bool get(TileStream *stream, Arena *arena, int port, int width, int height, int tile_size);
+    void release(TileStream *stream);
+
+    // Accepts a waiting client and sends what's left of the current message. Never blocks.
+    void poll(TileStream *stream, float dt);
+    // True if there's a client ready for the next update.
+    bool wants_frame(TileStream *stream);
+    // Builds update from RGBA float pixels in [0,1] and starts sending it.
+    void push_frame(TileStream *stream, float *pixels, int row_pitch, uint32_t step);
+
+    // Connects to the stream on given port of this machine and receives its header. Blocks.
+    bool connect(TileStreamClient *client, Arena *arena, int port);
+    void disconnect(TileStreamClient *client);
+    // Waits for the next update and applies it to client's frame.
+    StreamReceiveResult receive(TileStreamClient *client, UpdateHeader *update);
+}
@@ -0,0 +1,93 @@
+#include "visibility.h"
+#include <cassert>
+#include <math.h>
+#include <string.h>
+
+VisibilityBuffer visibility::get(Arena *arena, int width, int height) {
+    VisibilityBuffer buffer = {};
+    buffer.width = width;
+    buffer.height = height;
+    buffer.pixels = arena::push_array<uint32_t>(arena, size_t(width) * size_t(height));
+    assert(buffer.pixels);
+    return buffer;
+}
+
+// Adds sphere to pixel's list.
+static void add_sphere(uint32_t *pixel, int index) {
+    uint32_t value = *pixel;
+    uint32_t id = uint32_t(index + 1);
+    if(value == VISIBILITY_ALL) return;
+    if(value == 0) *pixel = id;
+    else if((value >> 16) == 0) *pixel = value | (id << 16);
+    else *pixel = VISIBILITY_ALL;
+}
+
+void visibility::build(VisibilityBuffer *buffer, Vector4 *spheres, int spheres_count, Vector3 camera_pos, CameraBasis *basis, float footprint_radius) {
+    int width = buffer->width, height = buffer->height;
+    memset(buffer->pixels, 0, size_t(width) * size_t(height) * sizeof(uint32_t));
+
+    // Film is at unit distance, so the footprint's size on the film bounds the angle between any ray within
+    // the footprint and the ray through the pixel's center.
+    float pixel_size = 2.0f * basis->film_half_width / float(width);
+    float footprint_angle = footprint_radius * pixel_size * 1.4143f;
+
+    Vector3 right = basis->right, up = basis->up, forward = basis->forward;
+    for(int i = 0; i < spheres_count; ++i) {
+        Vector4 sphere = spheres[i];
+        float vx = sphere.x - camera_pos.x, vy = sphere.y - camera_pos.y, vz = sphere.z - camera_pos.z;
+        float distance = sqrtf(vx * vx + vy * vy + vz * vz);
+
+        // Camera inside the sphere sees it everywhere.
+        if(distance <= sphere.w) {
+            for(int p = 0; p < width * height; ++p) add_sphere(&buffer->pixels[p], i);
+            continue;
+        }
+
+        // Rays within angle of sphere's angular radius plus the footprint from the sphere's direction can hit it.
+        float angle = asinf(sphere.w / distance) + footprint_angle;
+        float ax = vx / distance, ay = vy / distance, az = vz / distance;
+        float a_right = ax * right.x + ay * right.y + az * right.z;
+        float a_up = ax * up.x + ay * up.y + az * up.z;
+        float a_forward = ax * forward.x + ay * forward.y + az * forward.z;
+        float cos_angle = cosf(angle < 3.14159265f ? angle : 3.14159265f);
+
+        // Bounding box of the cone projected onto the film. Directions within the angle differ from the axis by at most
+        // the angle in every component, and their forward component is at least cosine of the axis' angle plus the cone's.
+        int x0 = 0, x1 = width - 1, y0 = 0, y1 = height - 1;
+        float axis_angle = acosf(a_forward < 1.0f ? a_forward : 1.0f);
+        if(axis_angle + angle < 1.5f) {
+            float min_forward = cosf(axis_angle + angle);
+            float x_min = a_right - angle, x_max = a_right + angle;
+            float y_min = a_up - angle, y_max = a_up + angle;
+            x_min /= x_min < 0.0f ? min_forward : 1.0f;
+            x_max /= x_max > 0.0f ? min_forward : 1.0f;
+            y_min /= y_min < 0.0f ? min_forward : 1.0f;
+            y_max /= y_max > 0.0f ? min_forward : 1.0f;
+
+            // Film coordinates to pixels, pixel's center is at its index + 0.5.
+            float fx0 = (x_min / basis->film_half_width + 1.0f) * 0.5f * width - 0.5f;
+            float fx1 = (x_max / basis->film_half_width + 1.0f) * 0.5f * width - 0.5f;
+            float fy0 = (y_min / basis->film_half_height + 1.0f) * 0.5f * height - 0.5f;
+            float fy1 = (y_max / basis->film_half_height + 1.0f) * 0.5f * height - 0.5f;
+            x0 = fx0 > 0.0f ? int(floorf(fx0)) : 0;
+            y0 = fy0 > 0.0f ? int(floorf(fy0)) : 0;
+            x1 = fx1 < float(width - 1) ? int(ceilf(fx1)) : width - 1;
+            y1 = fy1 < float(height - 1) ? int(ceilf(fy1)) : height - 1;
+        }
+
+        // Test ray through every pixel's center within the box against the cone.
+        for(int y = y0; y <= y1; ++y) {
+            float film_y = ((y + 0.5f) / height * 2.0f - 1.0f) * basis->film_half_height;
+            for(int x = x0; x <= x1; ++x) {
+                float film_x = ((x + 0.5f) / width * 2.0f - 1.0f) * basis->film_half_width;
+                float dx = film_x * right.x + film_y * up.x + forward.x;
+                float dy = film_x * right.y + film_y * up.y + forward.y;
+                float dz = film_x * right.z + film_y * up.z + forward.z;
+                float d_dot_a = dx * ax + dy * ay + dz * az;
+                if(d_dot_a >= cos_angle * sqrtf(dx * dx + dy * dy + dz * dz)) {
+                    add_sphere(&buffer->pixels[y * width + x], i);
+                }
+            }
+        }
+    }
+}
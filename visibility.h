@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+#include "maths.h"
+#include "arena.h"
+#include "camera.h"
+
+// Pixel whose footprint overlaps too many spheres, its primary rays have to test all of them.
+#define VISIBILITY_ALL 0xFFFFFFFF
+
+// Primary visibility of pinhole camera computed on the CPU. Every pixel stores up to two spheres whose projection
+// overlaps the pixel's filter footprint, as (index + 1) | (index + 1) << 16, zero meaning no sphere.
+// The list is conservative, so every primary ray traced within the footprint hits one of the listed spheres or nothing.
+struct VisibilityBuffer {
+    uint32_t *pixels;
+    int width, height;
+};
+
+namespace visibility {
+    VisibilityBuffer get(Arena *arena, int width, int height);
+
+    // Spheres' positions have radius in w. Footprint radius is in pixels from the pixel's center.
+    void build(VisibilityBuffer *buffer, Vector4 *spheres, int spheres_count, Vector3 camera_pos, CameraBasis *basis, float footprint_radius);
+}